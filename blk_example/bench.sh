@@ -0,0 +1,172 @@
+#!/bin/bash
+#
+# Benchmarks for blk_example.  Each scenario reloads the module with the
+# settings being compared and runs the same fio job against each of them.
+#
+# Usage: ./bench.sh <scenario>
+#
+
+DEV=/dev/blk_example
+RUNTIME=${RUNTIME:-30}
+
+load()
+{
+    sudo rmmod blk_example 2>/dev/null
+    sleep 1
+    sudo insmod blk_example.ko "$@" || exit 1
+}
+
+run_fio()
+{
+    sudo fio --name=bench --filename=$DEV --direct=1 --ioengine=io_uring \
+        --time_based --runtime=$RUNTIME --group_reporting "$@" | \
+        grep -E "IOPS=|lat \(usec\)|clat percentiles" -A0
+}
+
+# Like run_fio but also counts dTLB misses system wide while the job runs
+run_fio_tlb()
+{
+    sudo perf stat -a -e dTLB-loads,dTLB-load-misses,dTLB-stores,dTLB-store-misses \
+        -- fio --name=bench --filename=$DEV --direct=1 --ioengine=io_uring \
+        --time_based --runtime=$RUNTIME --group_reporting "$@" 2>&1 | \
+        grep -E "IOPS=|dTLB"
+}
+
+# .queue_rqs with batched completion vs. one queue_rq() call per request
+bench_queue_rqs()
+{
+    for batch in 0 1; do
+        echo "== io_mode=1 batch_dispatch=$batch"
+        load io_mode=1 hw_queue_depth=64 num_sectors=2097152 \
+            batch_dispatch=$batch
+        run_fio --rw=randread --bs=4k --iodepth=32 \
+            --iodepth_batch_submit=32 --iodepth_batch_complete_min=1 \
+            --numjobs=4
+    done
+}
+
+# 4K pages vs. huge vmalloc vs. 2 MiB compound pages for an 8 GiB flat store
+bench_huge()
+{
+    for huge in 0 1 2; do
+        echo "== huge_store=$huge"
+        load io_mode=1 hw_queue_depth=64 num_sectors=16777216 \
+            huge_store=$huge
+        sudo cat /sys/kernel/debug/blk_example/store
+        echo "-- 4k random read"
+        run_fio_tlb --rw=randread --bs=4k --iodepth=32 --numjobs=4
+        echo "-- 1M sequential read"
+        run_fio_tlb --rw=read --bs=1M --iodepth=8 --numjobs=4 \
+            --offset_increment=2g
+    done
+}
+
+# CPU cost of protection information: none vs. T10 CRC vs. IP checksum
+bench_pi()
+{
+    for pi in "pi_type=0" "pi_type=1 pi_guard=crc" "pi_type=1 pi_guard=ip"; do
+        echo "== $pi"
+        load io_mode=1 hw_queue_depth=64 num_sectors=16777216 $pi
+        echo "-- 1M sequential write"
+        run_fio --rw=write --bs=1M --iodepth=8 --numjobs=4 \
+            --offset_increment=2g
+        echo "-- 1M sequential read"
+        run_fio --rw=read --bs=1M --iodepth=8 --numjobs=4 \
+            --offset_increment=2g
+        sudo cat /sys/kernel/debug/blk_example/integrity 2>/dev/null
+    done
+}
+
+# Throughput and tail latency with a few requests delayed or dropped
+bench_faults()
+{
+    local dbg=/sys/kernel/debug/blk_example/faults
+
+    load io_mode=1 hw_queue_depth=64 num_sectors=2097152
+    echo 1000 | sudo tee /sys/block/blk_example/queue/io_timeout >/dev/null
+    for op in read write; do
+        echo 1 | sudo tee $dbg/$op/delay/probability >/dev/null
+        echo 0 | sudo tee $dbg/$op/drop/probability >/dev/null
+    done
+    echo 50 | sudo tee $dbg/delay_ms >/dev/null
+    echo "== 1% delayed 50ms"
+    run_fio --rw=randrw --bs=4k --iodepth=32 --numjobs=4
+    for op in read write; do
+        echo 1 | sudo tee $dbg/$op/drop/probability >/dev/null
+    done
+    echo "== 1% delayed 50ms, 1% dropped and retried after 1s"
+    run_fio --rw=randrw --bs=4k --iodepth=32 --numjobs=4 \
+        --continue_on_error=all
+    sudo head -5 $dbg/events
+}
+
+# Streaming 1M writes with cached vs. non-temporal copies, next to a
+# co-running job whose working set fits in the LLC.  The co-runner's
+# throughput and LLC misses show how much of the cache the writes evict.
+bench_nt()
+{
+    sudo dd if=/dev/urandom of=/dev/shm/blk_ex_hot bs=1M count=8 2>/dev/null
+    for nt in 0 65536; do
+        echo "== nt_threshold=$nt"
+        load io_mode=1 hw_queue_depth=64 num_sectors=16777216 \
+            nt_threshold=$nt
+        run_fio --rw=write --bs=1M --iodepth=8 --numjobs=4 \
+            --offset_increment=2g &
+        sleep 1
+        perf stat -e LLC-loads,LLC-load-misses -- \
+            fio --name=hot --filename=/dev/shm/blk_ex_hot --size=8m \
+            --rw=randread --bs=64 --ioengine=mmap --time_based \
+            --runtime=$((RUNTIME - 5)) 2>&1 | grep -E "IOPS=|LLC"
+        wait
+        sudo grep nt_write_bytes /sys/kernel/debug/blk_example/stats
+    done
+    rm -f /dev/shm/blk_ex_hot
+}
+
+# Zero-copy DAX mmap vs. the buffered path on ext4.  Needs RAM reserved
+# with memmap= at boot, e.g. DAX_MEM=4G@12G for memmap=4G!12G.
+bench_dax()
+{
+    local mnt=/mnt/blk_example
+
+    [ -n "$DAX_MEM" ] || { echo "Set DAX_MEM=size@start"; exit 1; }
+    load io_mode=1 hw_queue_depth=64 dax_mem=$DAX_MEM
+    sudo mkfs.ext4 -q -F $DEV
+    sudo mkdir -p $mnt
+    for opt in dax=never dax=always; do
+        sudo mount -o $opt $DEV $mnt || exit 1
+        for engine in mmap psync; do
+            echo "== mount -o $opt, $engine"
+            sudo fio --name=bench --directory=$mnt --size=512m \
+                --ioengine=$engine --rw=randrw --bs=4k --numjobs=4 \
+                --time_based --runtime=$RUNTIME --group_reporting | \
+                grep -E "IOPS=|lat \(usec\)"
+        done
+        sudo umount $mnt
+    done
+}
+
+case "$1" in
+queue_rqs)
+    bench_queue_rqs
+    ;;
+huge)
+    bench_huge
+    ;;
+pi)
+    bench_pi
+    ;;
+faults)
+    bench_faults
+    ;;
+nt)
+    bench_nt
+    ;;
+dax)
+    bench_dax
+    ;;
+*)
+    echo "Usage: $0 queue_rqs|huge|pi|faults|nt|dax"
+    exit 1
+    ;;
+esac
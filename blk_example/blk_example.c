@@ -13,6 +13,26 @@
 #include <linux/numa.h>
 #include <linux/vmalloc.h>
 #include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/sizes.h>
+#include <linux/string.h>
+#include <crypto/acompress.h>
+#include <linux/zsmalloc.h>
+#include <linux/sched/mm.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/idr.h>
+#include <linux/capability.h>
+#include <linux/dax.h>
+#include <linux/ioport.h>
+#include <linux/blk-integrity.h>
+#include <linux/crc-t10dif.h>
+#include <net/checksum.h>
 #include "blk_example.h"
 
 MODULE_LICENSE("GPL");
@@ -21,216 +41,4873 @@ MODULE_DESCRIPTION("Sample Block Driver");
 MODULE_VERSION("1");
 
 int blk_example_major;
-blk_example blk_ex;
 
-unsigned int num_sectors;
-module_param(num_sectors, uint, S_IRUGO);
+/*
+ * Every disk, whether made at load time, through configfs or as a snapshot,
+ * is on blk_example_devs.  blk_example_lock protects the list, the shared
+ * tag set and bringing disks up and down.
+ */
+static LIST_HEAD(blk_example_devs);
+static DEFINE_MUTEX(blk_example_lock);
+static DEFINE_IDA(blk_example_ida);
+
+/* Tag set of the shared_tags disks, set up by the first of them */
+static struct blk_mq_tag_set blk_example_shared_set;
+static unsigned int blk_example_shared_users;
+
+/* Timing model parsed from the module parameters, copied into new disks */
+static blk_example_emul blk_example_emul_def[2];
+
+/* Guard tag checksum from pi_guard */
+static enum blk_integrity_checksum blk_example_pi_csum_def =
+	BLK_INTEGRITY_CSUM_CRC;
+
+unsigned int nr_devices = 1;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of disks to create at load time, more can be added through configfs");
+
+unsigned long num_sectors;
+module_param(num_sectors, ulong, S_IRUGO);
+MODULE_PARM_DESC(num_sectors, "Size of the disk in 512 byte sectors");
+
+bool zoned;
+module_param(zoned, bool, S_IRUGO);
+MODULE_PARM_DESC(zoned, "Emulate a host-managed zoned block device");
+
+unsigned int zone_size = BLK_EX_ZONE_SIZE;
+module_param(zone_size, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_size, "Zone size in MB when zoned=1 (power of 2)");
+
+unsigned int zone_nr;
+module_param(zone_nr, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_nr, "Number of zones when zoned=1, overrides num_sectors");
+
+unsigned int zone_nr_conv;
+module_param(zone_nr_conv, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional zones at the start of the disk when zoned=1");
+
+bool sparse;
+module_param(sparse, bool, S_IRUGO);
+MODULE_PARM_DESC(sparse, "Allocate store pages on first write instead of up front");
+
+char *compress;
+module_param(compress, charp, S_IRUGO);
+MODULE_PARM_DESC(compress, "Compress store pages with this crypto algorithm, e.g. lz4 or zstd (implies sparse)");
+
+char *backing_file;
+module_param(backing_file, charp, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "Persist the store in this file, loaded on demand and written back in the background");
+
+unsigned int writeback_ms = BLK_EX_WB_MS;
+module_param(writeback_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(writeback_ms, "How often dirty pages are written back to backing_file in msecs");
+
+char *dax_mem;
+module_param(dax_mem, charp, S_IRUGO);
+MODULE_PARM_DESC(dax_mem, "Reserved RAM for a DAX capable store as size@start, e.g. 4G@12G from memmap=4G!12G");
+
+unsigned int huge_store = BLK_EX_HUGE_NONE;
+module_param(huge_store, uint, S_IRUGO);
+MODULE_PARM_DESC(huge_store, "Flat store mapping: 0 = 4K pages (default), 1 = huge vmalloc, 2 = 2 MiB compound pages");
+
+unsigned int pi_type;
+module_param(pi_type, uint, S_IRUGO);
+MODULE_PARM_DESC(pi_type, "T10 protection information type 1, 2 or 3 stored with each sector (default 0: none)");
+
+char *pi_guard = "crc";
+module_param(pi_guard, charp, S_IRUGO);
+MODULE_PARM_DESC(pi_guard, "Protection information guard tag: crc (T10 CRC, default) or ip (IP checksum)");
+
+unsigned int numa_mode = BLK_EX_NUMA_NONE;
+module_param(numa_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(numa_mode, "Store placement: 0=anywhere, 1=interleave stripes over nodes, 2=stripe on node of its hw queue");
+
+unsigned int io_mode = BLK_EX_IO_DEFERRED;
+module_param(io_mode, uint, S_IRUGO);
+MODULE_PARM_DESC(io_mode, "0=deferred to workqueue (default), 1=inline with one hw queue per CPU, 2=inline with hrtimer latency emulation");
+
+/* Timing model used with io_mode=2 */
+unsigned int read_lat_us;
+module_param(read_lat_us, uint, S_IRUGO);
+MODULE_PARM_DESC(read_lat_us, "Fixed read latency in usecs");
+
+unsigned int write_lat_us;
+module_param(write_lat_us, uint, S_IRUGO);
+MODULE_PARM_DESC(write_lat_us, "Fixed write latency in usecs");
+
+unsigned int read_jitter_us;
+module_param(read_jitter_us, uint, S_IRUGO);
+MODULE_PARM_DESC(read_jitter_us, "Uniformly distributed extra read latency in usecs");
+
+unsigned int write_jitter_us;
+module_param(write_jitter_us, uint, S_IRUGO);
+MODULE_PARM_DESC(write_jitter_us, "Uniformly distributed extra write latency in usecs");
+
+char *read_lat_table;
+module_param(read_lat_table, charp, S_IRUGO);
+MODULE_PARM_DESC(read_lat_table, "Read latency percentile table, e.g. \"50:80,99:400,99.9:2500\" (pct:usecs)");
+
+char *write_lat_table;
+module_param(write_lat_table, charp, S_IRUGO);
+MODULE_PARM_DESC(write_lat_table, "Write latency percentile table (pct:usecs)");
+
+unsigned int read_mbps;
+module_param(read_mbps, uint, S_IRUGO);
+MODULE_PARM_DESC(read_mbps, "Read bandwidth cap in MB/s (0=unlimited)");
+
+unsigned int write_mbps;
+module_param(write_mbps, uint, S_IRUGO);
+MODULE_PARM_DESC(write_mbps, "Write bandwidth cap in MB/s (0=unlimited)");
+
+unsigned int read_iops;
+module_param(read_iops, uint, S_IRUGO);
+MODULE_PARM_DESC(read_iops, "Read IOPS cap (0=unlimited)");
+
+unsigned int write_iops;
+module_param(write_iops, uint, S_IRUGO);
+MODULE_PARM_DESC(write_iops, "Write IOPS cap (0=unlimited)");
+
+unsigned int hw_queue_depth = BLK_EX_Q_DEPTH;
+module_param(hw_queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(hw_queue_depth, "Queue depth of each hardware queue");
+
+unsigned int submit_queues;
+module_param(submit_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of submission hardware queues (default 0: 1 for io_mode=0, one per CPU otherwise)");
+
+bool shared_tags;
+module_param(shared_tags, bool, S_IRUGO);
+MODULE_PARM_DESC(shared_tags, "Disks share one tag set instead of having their own");
+
+unsigned int poll_queues;
+module_param(poll_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_queues, "Number of polled hardware queues for io_uring IOPOLL (default 0)");
+
+bool batch_dispatch = true;
+module_param(batch_dispatch, bool, S_IRUGO);
+MODULE_PARM_DESC(batch_dispatch, "Process plugged request lists in contiguous runs with batched completion (io_mode=1)");
+
+bool stats = true;
+module_param(stats, bool, S_IRUGO);
+MODULE_PARM_DESC(stats, "Keep per hardware queue I/O counters and latency histograms in debugfs");
+
+bool write_cache;
+module_param(write_cache, bool, S_IRUGO);
+MODULE_PARM_DESC(write_cache, "Advertise a volatile write cache so the block layer sends flushes");
+
+unsigned int nt_threshold;
+module_param(nt_threshold, uint, 0644);
+MODULE_PARM_DESC(nt_threshold, "Writes of at least this many bytes bypass the CPU cache with non-temporal stores (default 0: never)");
+
+bool nomerges;
+module_param(nomerges, bool, S_IRUGO);
+MODULE_PARM_DESC(nomerges, "Disable request merging so each request is at most a page (old behaviour)");
+
+unsigned int max_sectors = BLK_EX_MAX_SECTORS;
+module_param(max_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(max_sectors, "Largest request in 512 byte sectors when merging is enabled");
+
+unsigned int stripe_size = BLK_EX_STRIPE_SIZE;
+module_param(stripe_size, uint, S_IRUGO);
+MODULE_PARM_DESC(stripe_size, "Bytes of store covered by a stripe lock (power of 2)");
+
+unsigned int nr_stripes = BLK_EX_NR_STRIPES;
+module_param(nr_stripes, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_stripes, "Number of stripe locks protecting the store (power of 2, at most 32)");
+
+/*
+ * Stripe locking.  A request only takes the locks for the stripes it touches.
+ * Stripes hash onto nr_stripes locks so the range of locks for a request is
+ * either one contiguous run or, when it wraps, two runs.  Locks are always
+ * taken in ascending index order so two requests can't deadlock.
+ *
+ * Each stripe index has its own lockdep class, so holding several stripes
+ * isn't reported as recursive locking and lockdep can still check the
+ * ordering.  A span of more than BLK_EX_STRIPE_NEST stripes takes span_lock
+ * first, so only one request at a time sweeps most of the lock array.
+ */
+static struct lock_class_key blk_example_stripe_keys[BLK_EX_MAX_STRIPES];
+
+static inline void blk_example_stripe_lock(blk_example *ex, unsigned int i,
+	bool write)
+{
+	rwlock_t *lock = &ex->stripes[i].lock;
+
+	if (write) {
+		if (!write_trylock(lock)) {
+			this_cpu_inc(ex->stripe_stats[i].wr_contended);
+			write_lock(lock);
+		}
+		this_cpu_inc(ex->stripe_stats[i].wr_acquired);
+	} else {
+		if (!read_trylock(lock)) {
+			this_cpu_inc(ex->stripe_stats[i].rd_contended);
+			read_lock(lock);
+		}
+		this_cpu_inc(ex->stripe_stats[i].rd_acquired);
+	}
+}
+
+static inline void blk_example_stripe_unlock(blk_example *ex, unsigned int i,
+	bool write)
+{
+	if (write)
+		write_unlock(&ex->stripes[i].lock);
+	else
+		read_unlock(&ex->stripes[i].lock);
+}
+
+/*
+ * Work out the first and last stripe lock covering [pos, pos + len).  If
+ * *first > *last the range wraps around the end of the lock array.  Returns
+ * how many locks that is.
+ */
+static unsigned int blk_example_stripe_span(blk_example *ex, u64 pos, u64 len,
+	unsigned int *first, unsigned int *last)
+{
+	u64 start = pos >> ex->stripe_shift;
+	u64 end = (pos + len - 1) >> ex->stripe_shift;
+
+	if (end - start + 1 >= ex->nr_stripes) {
+		*first = 0;
+		*last = ex->nr_stripes - 1;
+		return ex->nr_stripes;
+	}
+
+	*first = start & (ex->nr_stripes - 1);
+	*last = end & (ex->nr_stripes - 1);
+	return end - start + 1;
+}
+
+static void blk_example_lock_range(blk_example *ex, u64 pos, u64 len,
+	bool write)
+{
+	unsigned int first, last, i;
+
+	if (blk_example_stripe_span(ex, pos, len, &first, &last) >
+	    BLK_EX_STRIPE_NEST)
+		spin_lock(&ex->span_lock);
+
+	if (first <= last) {
+		for (i = first; i <= last; i++)
+			blk_example_stripe_lock(ex, i, write);
+	} else {
+		for (i = 0; i <= last; i++)
+			blk_example_stripe_lock(ex, i, write);
+		for (i = first; i < ex->nr_stripes; i++)
+			blk_example_stripe_lock(ex, i, write);
+	}
+}
+
+static void blk_example_unlock_range(blk_example *ex, u64 pos, u64 len,
+	bool write)
+{
+	unsigned int first, last, i, nr;
+
+	nr = blk_example_stripe_span(ex, pos, len, &first, &last);
+	if (first <= last) {
+		for (i = first; i <= last; i++)
+			blk_example_stripe_unlock(ex, i, write);
+	} else {
+		for (i = 0; i <= last; i++)
+			blk_example_stripe_unlock(ex, i, write);
+		for (i = first; i < ex->nr_stripes; i++)
+			blk_example_stripe_unlock(ex, i, write);
+	}
+
+	if (nr > BLK_EX_STRIPE_NEST)
+		spin_unlock(&ex->span_lock);
+}
+
+static int blk_example_alloc_stripes(blk_example *ex)
+{
+	unsigned int i;
+
+	ex->stripes = kcalloc(nr_stripes, sizeof(*ex->stripes), GFP_KERNEL);
+	if (!ex->stripes)
+		return -ENOMEM;
+
+	ex->stripe_stats = __alloc_percpu(nr_stripes *
+		sizeof(blk_example_stripe_stats),
+		__alignof__(blk_example_stripe_stats));
+	if (!ex->stripe_stats) {
+		kfree(ex->stripes);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_stripes; i++) {
+		rwlock_init(&ex->stripes[i].lock);
+		lockdep_set_class(&ex->stripes[i].lock,
+			&blk_example_stripe_keys[i]);
+	}
+	spin_lock_init(&ex->span_lock);
+	ex->nr_stripes = nr_stripes;
+	ex->stripe_shift = ilog2(stripe_size);
+	ex->chunk_shift = ex->stripe_shift;
+
+	return 0;
+}
+
+static void blk_example_free_stripes(blk_example *ex)
+{
+	free_percpu(ex->stripe_stats);
+	kfree(ex->stripes);
+}
+
+/*
+ * debugfs: per-stripe lock counters so the stripe count can be sized from
+ * real measurements.
+ */
+static int blk_example_stripes_show(struct seq_file *m, void *unused)
+{
+	blk_example *ex = m->private;
+	unsigned int i;
+
+	seq_printf(m, "stripe_size %u nr_stripes %u\n",
+		1U << ex->stripe_shift, ex->nr_stripes);
+	seq_puts(m, "stripe rd_acquired rd_contended wr_acquired wr_contended\n");
+	for (i = 0; i < ex->nr_stripes; i++) {
+		blk_example_stripe_stats sum = { };
+		int cpu;
+
+		for_each_possible_cpu(cpu) {
+			blk_example_stripe_stats *st =
+				per_cpu_ptr(&ex->stripe_stats[i], cpu);
+
+			sum.rd_acquired += st->rd_acquired;
+			sum.rd_contended += st->rd_contended;
+			sum.wr_acquired += st->wr_acquired;
+			sum.wr_contended += st->wr_contended;
+		}
+
+		seq_printf(m, "%u %llu %llu %llu %llu\n", i,
+			sum.rd_acquired, sum.rd_contended,
+			sum.wr_acquired, sum.wr_contended);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(blk_example_stripes);
+
+/*
+ * Backing store access.  The flat store is a single vmalloc() so any byte is
+ * just an offset from ex->store.  With numa_mode set the flat store is instead
+ * an array of stripe sized chunks, each allocated on the node picked for that
+ * stripe.  With huge_store=2 the chunks are 2 MiB compound pages, or whole
+ * stripes if those are bigger, and the node is picked for the chunk's first
+ * stripe.  The sparse store keeps one page per PAGE_SIZE of disk in an xarray
+ * and only allocates it the first time it's written.  A page that was never
+ * written is a hole and reads back as zeros.
+ */
+
+/* Which node a stripe of the store is placed on when numa_mode is set */
+static inline int blk_example_stripe_node(blk_example *ex, u64 pos)
+{
+	u32 idx;
+
+	/* A chunk is on one node even when it covers several stripes */
+	pos &= ~((1ULL << ex->chunk_shift) - 1);
+	div_u64_rem(pos >> ex->stripe_shift, ex->node_map_len, &idx);
+	return ex->node_map[idx];
+}
+
+/* How many bytes starting at pos are virtually contiguous in the store */
+static inline unsigned int blk_example_store_contig(blk_example *ex, u64 pos,
+	unsigned int len)
+{
+	u64 unit;
+
+	if (ex->sparse)
+		unit = PAGE_SIZE;
+	else if (ex->chunks)
+		unit = 1ULL << ex->chunk_shift;
+	else
+		return len;
+
+	return min_t(u64, len, unit - (pos & (unit - 1)));
+}
+
+/*
+ * Count bytes copied against the node they live on, and whether the CPU doing
+ * the copy was on the same node.
+ */
+static inline void blk_example_account_node(blk_example *ex, u64 pos,
+	unsigned int len)
+{
+	u64 *nb;
+	int node;
+
+	if (!ex->numa_mode)
+		return;
+
+	node = blk_example_stripe_node(ex, pos);
+	nb = get_cpu_ptr(ex->node_bytes);
+	nb[node * 2 + (node != numa_node_id())] += len;
+	put_cpu_ptr(ex->node_bytes);
+}
+
+/*
+ * Compressed store, compress=<alg>.  This is the sparse store but each page
+ * in the xarray is a blk_example_zpage pointing at a zsmalloc object holding
+ * the page compressed with the crypto API.  A page filled with one repeated
+ * word is kept as an xarray value entry and costs no memory at all, a zero
+ * page is just a hole.  Reads decompress into a small per-CPU direct mapped
+ * cache so re-reading a hot page is a memcpy.  Cache slots are tagged with
+ * the zpage's seq, which is unique for every write, so a slot left behind on
+ * another CPU simply stops matching once the page is rewritten.
+ */
+static void blk_example_store_free_entry(blk_example *ex, void *entry);
+
+#if IS_ENABLED(CONFIG_ZSMALLOC)
+static bool blk_example_page_same_filled(const void *ptr, unsigned long *val)
+{
+	const unsigned long *p = ptr;
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(*p); i++) {
+		if (p[i] != p[0])
+			return false;
+	}
+
+	*val = p[0];
+	return true;
+}
+
+static void blk_example_zpage_free(blk_example *ex, blk_example_zpage *zp)
+{
+	zs_free(ex->zpool, zp->handle);
+	atomic_long_sub(zp->len, &ex->zbytes);
+	kmem_cache_free(ex->zpage_cache, zp);
+}
+
+/* Uncompress the store entry for a whole page into dst */
+static int blk_example_zload(blk_example *ex, blk_example_zcpu *zc,
+	void *entry, void *dst, bool write)
+{
+	blk_example_zpage *zp = entry;
+	unsigned int dlen = PAGE_SIZE;
+	void *src;
+	u64 start;
+	int rc = 0;
+
+	if (!entry) {
+		memset(dst, 0, PAGE_SIZE);
+		return 0;
+	}
+
+	if (xa_is_value(entry)) {
+		memset_l(dst, xa_to_value(entry), PAGE_SIZE / sizeof(long));
+		return 0;
+	}
+
+	/* An object spanning two pages is copied into zc->dst to be read */
+	src = zs_obj_read_begin(ex->zpool, zp->handle, zc->dst);
+	if (zp->len == PAGE_SIZE) {
+		memcpy(dst, src, PAGE_SIZE);
+	} else {
+		start = ktime_get_ns();
+		acomp_request_set_src_nondma(zc->req, src, zp->len);
+		acomp_request_set_dst_nondma(zc->req, dst, PAGE_SIZE);
+		rc = crypto_acomp_decompress(zc->req);
+		dlen = zc->req->dlen;
+		zc->decomp_ns[write] += ktime_get_ns() - start;
+		zc->decomp_nr[write]++;
+	}
+	zs_obj_read_end(ex->zpool, zp->handle, src);
+
+	if (rc || dlen != PAGE_SIZE) {
+		pr_warn("%s(): corrupt page, rc %d len %u\n", __func__, rc, dlen);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Compress a whole page and make it the store entry for idx */
+static blk_status_t blk_example_zstore_page(blk_example *ex,
+	blk_example_zcpu *zc, pgoff_t idx, const void *data)
+{
+	blk_example_zpage *zp = NULL;
+	unsigned int dlen = 2 * PAGE_SIZE;
+	unsigned long val;
+	const void *src;
+	void *entry = NULL, *old;
+	u64 start;
+	int rc;
+
+	if (blk_example_page_same_filled(data, &val) && val <= LONG_MAX) {
+		if (val)
+			entry = xa_mk_value(val);
+		goto store;
+	}
+
+	start = ktime_get_ns();
+	acomp_request_set_src_nondma(zc->req, data, PAGE_SIZE);
+	acomp_request_set_dst_nondma(zc->req, zc->dst, dlen);
+	rc = crypto_acomp_compress(zc->req);
+	dlen = zc->req->dlen;
+	zc->comp_ns += ktime_get_ns() - start;
+	zc->comp_nr++;
+
+	if (rc || dlen > BLK_EX_ZMAX_LEN) {
+		src = data;
+		dlen = PAGE_SIZE;
+	} else {
+		src = zc->dst;
+	}
+
+	zp = kmem_cache_alloc(ex->zpage_cache, GFP_NOWAIT | __GFP_NOWARN);
+	if (!zp)
+		return BLK_STS_RESOURCE;
+
+	zp->handle = zs_malloc(ex->zpool, dlen, GFP_NOWAIT | __GFP_NOWARN |
+		__GFP_HIGHMEM | __GFP_MOVABLE);
+	if (IS_ERR_VALUE(zp->handle)) {
+		kmem_cache_free(ex->zpage_cache, zp);
+		return BLK_STS_RESOURCE;
+	}
+
+	zs_obj_write(ex->zpool, zp->handle, (void *)src, dlen);
+
+	zp->len = dlen;
+	zp->seq = atomic64_inc_return(&ex->zseq);
+	atomic_long_add(dlen, &ex->zbytes);
+	entry = zp;
+
+store:
+	if (entry)
+		old = xa_store(ex->pages, idx, entry, GFP_NOWAIT);
+	else
+		old = xa_erase(ex->pages, idx);
+
+	if (xa_is_err(old)) {
+		if (zp)
+			blk_example_zpage_free(ex, zp);
+		return BLK_STS_RESOURCE;
+	}
+
+	if (zp)
+		atomic_long_inc(&ex->nr_pages);
+	else if (entry)
+		atomic_long_inc(&ex->nr_same);
+	blk_example_store_free_entry(ex, old);
+
+	return BLK_STS_OK;
+}
+
+/* Write len bytes at pos, partial pages are read, modified and recompressed */
+static blk_status_t blk_example_zstore_write(blk_example *ex, u64 pos,
+	const void *src, unsigned int len)
+{
+	blk_example_zcpu *zc = this_cpu_ptr(ex->zcpu);
+	unsigned int chunk, off;
+	blk_status_t status;
+	const void *data;
+
+	while (len) {
+		off = offset_in_page(pos);
+		chunk = min_t(unsigned int, len, PAGE_SIZE - off);
+
+		if (chunk == PAGE_SIZE) {
+			data = src;
+		} else {
+			if (blk_example_zload(ex, zc,
+			    xa_load(ex->pages, pos >> PAGE_SHIFT),
+			    zc->page, true))
+				return BLK_STS_IOERR;
+			memcpy(zc->page + off, src, chunk);
+			data = zc->page;
+		}
+
+		status = blk_example_zstore_page(ex, zc, pos >> PAGE_SHIFT,
+			data);
+		if (status)
+			return status;
+
+		pos += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t blk_example_zstore_read(blk_example *ex, u64 pos,
+	void *dst, unsigned int len)
+{
+	blk_example_zcpu *zc = this_cpu_ptr(ex->zcpu);
+	unsigned int chunk, off;
+	blk_example_zpage *zp;
+	pgoff_t idx;
+	blk_example_zslot *slot;
+	void *entry;
+
+	while (len) {
+		off = offset_in_page(pos);
+		chunk = min_t(unsigned int, len, PAGE_SIZE - off);
+		idx = pos >> PAGE_SHIFT;
+
+		entry = xa_load(ex->pages, idx);
+		if (!entry) {
+			memset(dst, 0, chunk);
+		} else if (xa_is_value(entry)) {
+			memset_l(dst, xa_to_value(entry), chunk / sizeof(long));
+		} else {
+			zp = entry;
+			slot = &zc->cache[idx % BLK_EX_ZCACHE_SLOTS];
+			if (slot->seq == zp->seq) {
+				zc->cache_hits++;
+			} else {
+				zc->cache_misses++;
+				slot->seq = 0;
+				if (blk_example_zload(ex, zc, entry, slot->data,
+				    false))
+					return BLK_STS_IOERR;
+				slot->seq = zp->seq;
+			}
+			memcpy(dst, slot->data + off, chunk);
+		}
+
+		pos += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+
+	return BLK_STS_OK;
+}
+
+static void blk_example_zstore_exit(blk_example *ex)
+{
+	blk_example_zcpu *zc;
+	unsigned int i;
+	int cpu;
+
+	if (ex->zcpu) {
+		for_each_possible_cpu(cpu) {
+			zc = per_cpu_ptr(ex->zcpu, cpu);
+			if (zc->req)
+				acomp_request_free(zc->req);
+			if (!IS_ERR_OR_NULL(zc->tfm))
+				crypto_free_acomp(zc->tfm);
+			kfree(zc->dst);
+			kfree(zc->page);
+			for (i = 0; i < BLK_EX_ZCACHE_SLOTS; i++)
+				kfree(zc->cache[i].data);
+		}
+		free_percpu(ex->zcpu);
+	}
+	if (ex->zpool)
+		zs_destroy_pool(ex->zpool);
+	kmem_cache_destroy(ex->zpage_cache);
+}
+
+static int blk_example_zstore_init(blk_example *ex, const char *alg)
+{
+	blk_example_zcpu *zc;
+	unsigned int i;
+	int cpu;
+
+	/*
+	 * Masking out CRYPTO_ALG_ASYNC gets a synchronous implementation, we
+	 * compress with the stripe locks held and can't wait for a callback.
+	 */
+	if (!crypto_has_acomp(alg, 0, CRYPTO_ALG_ASYNC)) {
+		pr_warn("%s(): compression algorithm %s not available\n",
+			__func__, alg);
+		return -ENOENT;
+	}
+
+	ex->zpage_cache = kmem_cache_create("blk_example_zpage",
+		sizeof(blk_example_zpage), 0, 0, NULL);
+	ex->zpool = zs_create_pool(DRV_NAME);
+	ex->zcpu = alloc_percpu(blk_example_zcpu);
+	if (!ex->zpage_cache || !ex->zpool || !ex->zcpu)
+		goto out_free;
+
+	for_each_possible_cpu(cpu) {
+		int node = cpu_to_node(cpu);
+
+		zc = per_cpu_ptr(ex->zcpu, cpu);
+		zc->tfm = crypto_alloc_acomp_node(alg, 0, CRYPTO_ALG_ASYNC, node);
+		if (IS_ERR(zc->tfm))
+			goto out_free;
+		zc->req = acomp_request_alloc(zc->tfm);
+		if (!zc->req)
+			goto out_free;
+		zc->dst = kmalloc_node(2 * PAGE_SIZE, GFP_KERNEL, node);
+		zc->page = kmalloc_node(PAGE_SIZE, GFP_KERNEL, node);
+		if (!zc->dst || !zc->page)
+			goto out_free;
+		for (i = 0; i < BLK_EX_ZCACHE_SLOTS; i++) {
+			zc->cache[i].data = kmalloc_node(PAGE_SIZE, GFP_KERNEL,
+				node);
+			if (!zc->cache[i].data)
+				goto out_free;
+		}
+	}
+
+	atomic64_set(&ex->zseq, 0);
+	atomic_long_set(&ex->zbytes, 0);
+	atomic_long_set(&ex->nr_same, 0);
+	ex->compressed = true;
+	return 0;
+
+out_free:
+	blk_example_zstore_exit(ex);
+	return -ENOMEM;
+}
+
+static void blk_example_zstore_show(struct seq_file *m, blk_example *ex)
+{
+	long pages = atomic_long_read(&ex->nr_pages);
+	long zbytes = atomic_long_read(&ex->zbytes);
+	u64 comp_nr = 0, comp_ns = 0, hits = 0, misses = 0;
+	u64 decomp_nr[2] = { 0 }, decomp_ns[2] = { 0 };
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		blk_example_zcpu *zc = per_cpu_ptr(ex->zcpu, cpu);
+
+		comp_nr += zc->comp_nr;
+		comp_ns += zc->comp_ns;
+		for (i = 0; i < 2; i++) {
+			decomp_nr[i] += zc->decomp_nr[i];
+			decomp_ns[i] += zc->decomp_ns[i];
+		}
+		hits += zc->cache_hits;
+		misses += zc->cache_misses;
+	}
+
+	seq_printf(m, "compressed_pages %ld\n", pages);
+	seq_printf(m, "same_filled_pages %ld\n", atomic_long_read(&ex->nr_same));
+	seq_printf(m, "compressed_bytes %ld\n", zbytes);
+	seq_printf(m, "pool_bytes %lu\n",
+		zs_get_total_pages(ex->zpool) << PAGE_SHIFT);
+	/* Ratio of data held to compressed size, x100 */
+	seq_printf(m, "ratio_x100 %llu\n", zbytes ?
+		div64_u64((u64)pages * PAGE_SIZE * 100, zbytes) : 0);
+	seq_printf(m, "compress %llu avg_ns %llu\n", comp_nr,
+		comp_nr ? div64_u64(comp_ns, comp_nr) : 0);
+	seq_printf(m, "decompress_read %llu avg_ns %llu\n", decomp_nr[0],
+		decomp_nr[0] ? div64_u64(decomp_ns[0], decomp_nr[0]) : 0);
+	seq_printf(m, "decompress_write %llu avg_ns %llu\n", decomp_nr[1],
+		decomp_nr[1] ? div64_u64(decomp_ns[1], decomp_nr[1]) : 0);
+	seq_printf(m, "cache_hits %llu cache_misses %llu\n", hits, misses);
+}
+#else
+static inline void blk_example_zpage_free(blk_example *ex,
+	blk_example_zpage *zp)
+{
+}
+
+static inline blk_status_t blk_example_zstore_write(blk_example *ex, u64 pos,
+	const void *src, unsigned int len)
+{
+	return BLK_STS_NOTSUPP;
+}
+
+static inline blk_status_t blk_example_zstore_read(blk_example *ex, u64 pos,
+	void *dst, unsigned int len)
+{
+	return BLK_STS_NOTSUPP;
+}
+
+static inline void blk_example_zstore_exit(blk_example *ex)
+{
+}
+
+static inline int blk_example_zstore_init(blk_example *ex, const char *alg)
+{
+	pr_warn("%s(): compress needs CONFIG_ZSMALLOC\n", __func__);
+	return -EOPNOTSUPP;
+}
+
+static inline void blk_example_zstore_show(struct seq_file *m,
+	blk_example *ex)
+{
+}
+#endif
+
+/* Give back whatever a sparse store entry holds, caller already removed it */
+static void blk_example_store_free_entry(blk_example *ex, void *entry)
+{
+	if (!entry)
+		return;
+
+	if (xa_is_value(entry)) {
+		atomic_long_dec(&ex->nr_same);
+		return;
+	}
+
+	if (ex->compressed)
+		blk_example_zpage_free(ex, entry);
+	else
+		__free_page(entry);
+	atomic_long_dec(&ex->nr_pages);
+}
+
+/*
+ * Snapshot layers.  The sparse store of a disk is a stack of layers: ex->top
+ * takes every write and the layers under it are frozen and may be shared
+ * with other disks.  A page that isn't in a layer is looked up in the one
+ * below, so after a snapshot both disks see the same data and each only
+ * allocates pages it writes to.
+ */
+static blk_example_layer *blk_example_layer_alloc(blk_example_layer *parent)
+{
+	blk_example_layer *layer;
+
+	layer = kzalloc(sizeof(*layer), GFP_KERNEL);
+	if (!layer)
+		return NULL;
+
+	xa_init(&layer->pages);
+	refcount_set(&layer->ref, 1);
+	layer->parent = parent;
+	if (parent)
+		refcount_inc(&parent->ref);
+
+	return layer;
+}
+
+/* Drop a reference to a frozen layer, which only ever holds plain pages */
+static void blk_example_layer_put(blk_example_layer *layer)
+{
+	blk_example_layer *parent;
+	unsigned long idx;
+	void *entry;
+
+	while (layer && refcount_dec_and_test(&layer->ref)) {
+		xa_for_each(&layer->pages, idx, entry) {
+			if (!xa_is_value(entry))
+				__free_page(entry);
+		}
+		xa_destroy(&layer->pages);
+		parent = layer->parent;
+		kfree(layer);
+		layer = parent;
+	}
+}
+
+/* First entry for idx in layer or the ones below it */
+static void *blk_example_layer_lookup(blk_example_layer *layer, pgoff_t idx)
+{
+	void *entry;
+
+	for (; layer; layer = layer->parent) {
+		entry = xa_load(&layer->pages, idx);
+		if (entry)
+			return entry;
+	}
+
+	return NULL;
+}
+
+/*
+ * With a backing file, note that the page at pos needs writing back.  Caller
+ * holds its stripe lock for writing, which keeps writeback from clearing the
+ * mark between the test and the set.
+ */
+static inline void blk_example_store_dirty(blk_example *ex, u64 pos)
+{
+	pgoff_t idx = pos >> PAGE_SHIFT;
+
+	if (ex->file && !xa_get_mark(ex->pages, idx, BLK_EX_DIRTY))
+		xa_set_mark(ex->pages, idx, BLK_EX_DIRTY);
+}
+
+static void *blk_example_store_lookup(blk_example *ex, u64 pos)
+{
+	struct page *page;
+
+	if (!ex->sparse) {
+		if (ex->chunks)
+			return ex->chunks[pos >> ex->chunk_shift] +
+				(pos & ((1ULL << ex->chunk_shift) - 1));
+		return ex->store + pos;
+	}
+
+	/*
+	 * A value entry is a zero page loaded from the backing file, or a
+	 * page discarded since a snapshot that mustn't show through from the
+	 * layer below.
+	 */
+	page = xa_load(ex->pages, pos >> PAGE_SHIFT);
+	if (!page && ex->top->parent)
+		page = blk_example_layer_lookup(ex->top->parent,
+			pos >> PAGE_SHIFT);
+	if (!page || xa_is_value(page))
+		return NULL;
+
+	return page_address(page) + offset_in_page(pos);
+}
+
+/*
+ * Like blk_example_store_lookup() but always returns a page of our own top
+ * layer, filling in a hole with a zeroed page or copying a page shared with
+ * a snapshot.
+ */
+static void *blk_example_store_insert(blk_example *ex, u64 pos, gfp_t gfp)
+{
+	pgoff_t idx = pos >> PAGE_SHIFT;
+	struct page *page, *old, *cur, *src = NULL;
+	int node = NUMA_NO_NODE;
+
+	if (!ex->sparse)
+		return blk_example_store_lookup(ex, pos);
+
+	if (ex->numa_mode)
+		node = blk_example_stripe_node(ex, pos);
+
+retry:
+	old = xa_load(ex->pages, idx);
+	if (old && !xa_is_value(old)) {
+		page = old;
+		goto out;
+	}
+
+	/* Copy on first write, the layers below never change */
+	if (!old && ex->top->parent) {
+		src = blk_example_layer_lookup(ex->top->parent, idx);
+		if (xa_is_value(src))
+			src = NULL;
+	}
+
+	page = alloc_pages_node(node, gfp | __GFP_NOWARN |
+		(src ? 0 : __GFP_ZERO), 0);
+	if (!page)
+		return NULL;
+	if (src)
+		copy_page(page_address(page), page_address(src));
+
+	/* Somebody else may have filled the hole while we were allocating */
+	cur = xa_cmpxchg(ex->pages, idx, old, page, gfp);
+	if (unlikely(cur != old)) {
+		__free_page(page);
+		if (xa_is_err(cur))
+			return NULL;
+		goto retry;
+	}
+	blk_example_store_free_entry(ex, old);
+	atomic_long_inc(&ex->nr_pages);
+
+out:
+	return page_address(page) + offset_in_page(pos);
+}
+
+/*
+ * Make sure every store page in [pos, pos + len) exists before we take the
+ * stripe locks, since we can't sleep once we hold them.
+ */
+static blk_status_t blk_example_store_prealloc(blk_example *ex, u64 pos,
+	u64 len, gfp_t gfp)
+{
+	u64 end = pos + len;
+
+	/* Compressed pages are sized by their contents, nothing to do yet */
+	if (ex->compressed)
+		return BLK_STS_OK;
+
+	pos = round_down(pos, PAGE_SIZE);
+	for (; pos < end; pos += PAGE_SIZE) {
+		if (!blk_example_store_insert(ex, pos, gfp))
+			return BLK_STS_RESOURCE;
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Copy len bytes from src into the store at pos.  With nt set the copy uses
+ * non-temporal stores where the arch has them, so a big streaming write
+ * doesn't push everything else out of the LLC.  The caller has to wmb()
+ * before anyone else can look at what was written.
+ */
+static blk_status_t blk_example_store_write(blk_example *ex, u64 pos,
+	const void *src, unsigned int len, bool nt)
+{
+	unsigned int chunk;
+	void *addr;
+
+	if (ex->compressed)
+		return blk_example_zstore_write(ex, pos, src, len);
+
+	while (len) {
+		chunk = blk_example_store_contig(ex, pos, len);
+
+		/*
+		 * A sparse page was normally preallocated, this only
+		 * allocates if we raced with something that freed it.
+		 */
+		addr = blk_example_store_insert(ex, pos, GFP_NOWAIT);
+		if (!addr)
+			return BLK_STS_RESOURCE;
+
+		if (nt)
+			memcpy_flushcache(addr, src, chunk);
+		else
+			memcpy(addr, src, chunk);
+		blk_example_account_node(ex, pos, chunk);
+		blk_example_store_dirty(ex, pos);
+		pos += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+
+	return BLK_STS_OK;
+}
+
+/* Copy len bytes from the store at pos into dst, holes read as zeros */
+static blk_status_t blk_example_store_read(blk_example *ex, u64 pos,
+	void *dst, unsigned int len)
+{
+	unsigned int chunk;
+	void *addr;
+
+	if (ex->compressed)
+		return blk_example_zstore_read(ex, pos, dst, len);
+
+	while (len) {
+		chunk = blk_example_store_contig(ex, pos, len);
+
+		addr = blk_example_store_lookup(ex, pos);
+		if (addr) {
+			memcpy(dst, addr, chunk);
+			blk_example_account_node(ex, pos, chunk);
+		} else {
+			memset(dst, 0, chunk);
+		}
+
+		pos += chunk;
+		dst += chunk;
+		len -= chunk;
+	}
+
+	return BLK_STS_OK;
+}
+
+/* Zero part of a sparse store page in place, copying it first if shared */
+static blk_status_t blk_example_store_zero(blk_example *ex, u64 pos,
+	unsigned int len)
+{
+	void *addr;
+
+	addr = blk_example_store_lookup(ex, pos);
+	if (!addr)
+		return BLK_STS_OK;
+
+	if (ex->top->parent) {
+		addr = blk_example_store_insert(ex, pos, GFP_NOWAIT);
+		if (!addr)
+			return BLK_STS_RESOURCE;
+	}
+
+	memset(addr, 0, len);
+	blk_example_store_dirty(ex, pos);
+	return BLK_STS_OK;
+}
+
+/*
+ * Zero [pos, pos + len) in the store.  In the sparse store every page that is
+ * completely covered is freed back to the system, only partial pages at either
+ * end are zeroed in place.  Caller holds the stripe locks for writing.
+ */
+static blk_status_t blk_example_store_discard(blk_example *ex, u64 pos,
+	u64 len)
+{
+	u64 end = pos + len;
+	blk_example_layer *layer;
+	blk_status_t status;
+	unsigned long idx;
+	unsigned int chunk;
+	void *entry;
+
+	if (!ex->sparse) {
+		while (pos < end) {
+			chunk = blk_example_store_contig(ex, pos,
+				min_t(u64, end - pos, UINT_MAX));
+			memset(blk_example_store_lookup(ex, pos), 0, chunk);
+			pos += chunk;
+		}
+		return BLK_STS_OK;
+	}
+
+	/* Partial page at the start */
+	if (offset_in_page(pos)) {
+		chunk = min_t(u64, len, PAGE_SIZE - offset_in_page(pos));
+		if (ex->compressed) {
+			status = blk_example_zstore_write(ex, pos,
+				page_address(ZERO_PAGE(0)), chunk);
+			if (status)
+				return status;
+		} else {
+			status = blk_example_store_zero(ex, pos, chunk);
+			if (status)
+				return status;
+		}
+		pos += chunk;
+	}
+
+	/* Partial page at the end */
+	if (offset_in_page(end) && end > pos) {
+		if (ex->compressed) {
+			status = blk_example_zstore_write(ex,
+				round_down(end, PAGE_SIZE),
+				page_address(ZERO_PAGE(0)), offset_in_page(end));
+			if (status)
+				return status;
+		} else {
+			status = blk_example_store_zero(ex,
+				round_down(end, PAGE_SIZE), offset_in_page(end));
+			if (status)
+				return status;
+		}
+		end = round_down(end, PAGE_SIZE);
+	}
+
+	if (pos >= end)
+		return BLK_STS_OK;
+
+	/* Only visit pages that actually exist so trimming a big hole is cheap */
+	xa_for_each_range(ex->pages, idx, entry, pos >> PAGE_SHIFT,
+			  (end >> PAGE_SHIFT) - 1) {
+		xa_erase(ex->pages, idx);
+		blk_example_store_free_entry(ex, entry);
+	}
+
+	/* Hide pages of the layers below behind zero entries */
+	for (layer = ex->top->parent; layer; layer = layer->parent) {
+		xa_for_each_range(&layer->pages, idx, entry, pos >> PAGE_SHIFT,
+				  (end >> PAGE_SHIFT) - 1) {
+			int rc;
+
+			if (xa_is_value(entry))
+				continue;
+			rc = xa_insert(ex->pages, idx, xa_mk_value(0),
+				GFP_NOWAIT);
+			if (rc == -EBUSY)
+				continue;
+			if (rc)
+				return BLK_STS_RESOURCE;
+			atomic_long_inc(&ex->nr_same);
+		}
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * File backed store, backing_file=<path>.  The store is the sparse one and the
+ * file is what a missing page means: a page not in the xarray hasn't been
+ * loaded yet and is read from the file the first time a request touches it.
+ * Reads from a file need to sleep, so that's done before the stripe locks are
+ * taken and the tag set is BLK_MQ_F_BLOCKING.  Writes only mark the page dirty
+ * and the writeback work copies dirty pages out every writeback_ms, so the
+ * I/O path still runs at memory speed.  A flush writes everything back and
+ * fsyncs the file.
+ *
+ * Once loaded a page stays in memory.  Discard frees pages and punches the
+ * same range out of the file, so they can be "loaded" again as zeros.  Loads,
+ * writeback and hole punching are ordered by file_lock so writeback can never
+ * put back data that a discard just dropped.  Zero pages read from the file
+ * are kept as a value entry so a hole is only read once.
+ *
+ * Everything that calls into the filesystem runs in a memalloc_noio_save()
+ * scope, the way loop does with PF_MEMALLOC_NOIO.  Otherwise page cache and
+ * filesystem allocations could recurse into reclaim that writes back to this
+ * disk, which then waits on us, or on file_lock held by the writeback work.
+ */
+
+/* Read page idx in from the backing file unless someone already did */
+static blk_status_t blk_example_file_load(blk_example *ex, pgoff_t idx)
+{
+	loff_t off = (loff_t)idx << PAGE_SHIFT;
+	unsigned int noio;
+	struct page *page;
+	void *entry, *cur;
+	ssize_t ret;
+
+	page = alloc_page(GFP_NOIO | __GFP_ZERO);
+	if (!page)
+		return BLK_STS_RESOURCE;
+
+	mutex_lock(&ex->file_lock);
+	if (xa_load(ex->pages, idx)) {
+		mutex_unlock(&ex->file_lock);
+		__free_page(page);
+		return BLK_STS_OK;
+	}
+
+	/* Past the end of the file reads as zeros */
+	noio = memalloc_noio_save();
+	ret = kernel_read(ex->file, page_address(page), PAGE_SIZE, &off);
+	memalloc_noio_restore(noio);
+	if (ret < 0) {
+		mutex_unlock(&ex->file_lock);
+		__free_page(page);
+		pr_warn("%s(): read of page %lu failed, rc=%zd\n", __func__,
+			idx, ret);
+		return BLK_STS_IOERR;
+	}
+
+	/* Don't spend a page on a hole in the file */
+	entry = page;
+	if (!memchr_inv(page_address(page), 0, PAGE_SIZE))
+		entry = xa_mk_value(0);
+
+	cur = xa_cmpxchg(ex->pages, idx, NULL, entry, GFP_NOIO);
+	mutex_unlock(&ex->file_lock);
+
+	if (entry != page || cur)
+		__free_page(page);
+	if (xa_is_err(cur))
+		return BLK_STS_RESOURCE;
+
+	if (!cur) {
+		if (entry == page)
+			atomic_long_inc(&ex->nr_pages);
+		else
+			atomic_long_inc(&ex->nr_same);
+		atomic_long_inc(&ex->file_loads);
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Load every page of [pos, pos + len) we don't have yet.  A write doesn't need
+ * the old contents of pages it covers completely.
+ */
+static blk_status_t blk_example_file_fault(blk_example *ex, u64 pos, u64 len,
+	bool write, bool can_sleep)
+{
+	u64 end = pos + len;
+	blk_status_t status;
+	pgoff_t idx;
+
+	for (idx = pos >> PAGE_SHIFT; ((u64)idx << PAGE_SHIFT) < end; idx++) {
+		u64 start = (u64)idx << PAGE_SHIFT;
+
+		if (write && start >= pos && start + PAGE_SIZE <= end)
+			continue;
+		if (xa_load(ex->pages, idx))
+			continue;
+		if (!can_sleep)
+			return BLK_STS_RESOURCE;
+
+		status = blk_example_file_load(ex, idx);
+		if (status)
+			return status;
+	}
+
+	return BLK_STS_OK;
+}
+
+/* Write nr pages staged in wb_buf to the file at page first */
+static int blk_example_file_write_run(blk_example *ex, pgoff_t first,
+	unsigned int nr)
+{
+	loff_t off = (loff_t)first << PAGE_SHIFT;
+	size_t len = min_t(u64, (u64)nr << PAGE_SHIFT, ex->capacity - off);
+	ssize_t ret;
+	unsigned int i;
+
+	ret = kernel_write(ex->file, ex->wb_buf, len, &off);
+	if (ret == (ssize_t)len) {
+		atomic_long_add(nr, &ex->file_written);
+		return 0;
+	}
+
+	/* Try again next time round */
+	for (i = 0; i < nr; i++)
+		xa_set_mark(ex->pages, first + i, BLK_EX_DIRTY);
+	pr_warn("%s(): write at page %lu failed, rc=%zd\n", __func__, first, ret);
+	return ret < 0 ? ret : -EIO;
+}
+
+/*
+ * Copy every dirty page out to the file.  Each page is snapshotted under its
+ * stripe lock and its dirty mark cleared there, so a write racing with us
+ * simply marks it dirty again.  Contiguous dirty pages go out as one write.
+ */
+static int blk_example_file_writeback(blk_example *ex)
+{
+	pgoff_t idx, first = 0;
+	unsigned int nr = 0, noio;
+	void *entry;
+	int rc = 0;
+
+	noio = memalloc_noio_save();
+	mutex_lock(&ex->file_lock);
+	xa_for_each_marked(ex->pages, idx, entry, BLK_EX_DIRTY) {
+		u64 pos = (u64)idx << PAGE_SHIFT;
+		void *dst;
+
+		if (nr && (idx != first + nr || nr == BLK_EX_WB_PAGES)) {
+			rc = blk_example_file_write_run(ex, first, nr);
+			if (rc)
+				break;
+			nr = 0;
+			cond_resched();
+		}
+		if (!nr)
+			first = idx;
+
+		dst = ex->wb_buf + ((size_t)nr << PAGE_SHIFT);
+		blk_example_lock_range(ex, pos, PAGE_SIZE, false);
+		entry = xa_load(ex->pages, idx);
+		if (entry && !xa_is_value(entry))
+			memcpy(dst, page_address(entry), PAGE_SIZE);
+		else
+			memset(dst, 0, PAGE_SIZE);
+		xa_clear_mark(ex->pages, idx, BLK_EX_DIRTY);
+		blk_example_unlock_range(ex, pos, PAGE_SIZE, false);
+		nr++;
+	}
+	if (!rc && nr)
+		rc = blk_example_file_write_run(ex, first, nr);
+	mutex_unlock(&ex->file_lock);
+	memalloc_noio_restore(noio);
+
+	return rc;
+}
+
+static void blk_example_file_wb_work(struct work_struct *work)
+{
+	blk_example *ex = container_of(to_delayed_work(work), blk_example,
+		wb_work);
+
+	blk_example_file_writeback(ex);
+	queue_delayed_work(system_unbound_wq, &ex->wb_work,
+		msecs_to_jiffies(writeback_ms));
+}
+
+/* REQ_OP_FLUSH: everything written so far has to be on stable storage */
+static blk_status_t blk_example_file_flush(blk_example *ex)
+{
+	unsigned int noio;
+	int rc;
+
+	rc = blk_example_file_writeback(ex);
+	if (!rc) {
+		noio = memalloc_noio_save();
+		rc = vfs_fsync(ex->file, 0);
+		memalloc_noio_restore(noio);
+	}
+	if (rc)
+		return BLK_STS_IOERR;
+
+	atomic_long_inc(&ex->file_flushes);
+	return BLK_STS_OK;
+}
+
+/* Overwrite [start, end) of the file with zeros */
+static int blk_example_file_zero(blk_example *ex, loff_t start, loff_t end)
+{
+	ssize_t ret;
+
+	while (start < end) {
+		ret = kernel_write(ex->file, page_address(ZERO_PAGE(0)),
+			min_t(loff_t, end - start, PAGE_SIZE), &start);
+		if (ret <= 0)
+			return ret < 0 ? ret : -EIO;
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static int blk_example_file_open(blk_example *ex, const char *path)
+{
+	ex->file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+	if (IS_ERR(ex->file)) {
+		pr_warn("%s(): can't open %s, rc=%ld\n", __func__, path,
+			PTR_ERR(ex->file));
+		return PTR_ERR(ex->file);
+	}
+
+	/* No size given, the disk is as big as the file */
+	if (!ex->capacity) {
+		ex->capacity = round_down(i_size_read(file_inode(ex->file)),
+			SECTOR_SIZE);
+		if (!ex->capacity) {
+			pr_warn("%s(): %s is empty, set num_sectors\n",
+				__func__, path);
+			fput(ex->file);
+			ex->file = NULL;
+			return -EINVAL;
+		}
+	}
+
+	ex->wb_buf = vmalloc((size_t)BLK_EX_WB_PAGES << PAGE_SHIFT);
+	if (!ex->wb_buf) {
+		fput(ex->file);
+		ex->file = NULL;
+		return -ENOMEM;
+	}
+
+	mutex_init(&ex->file_lock);
+	atomic_long_set(&ex->file_loads, 0);
+	atomic_long_set(&ex->file_written, 0);
+	atomic_long_set(&ex->file_flushes, 0);
+	INIT_DELAYED_WORK(&ex->wb_work, blk_example_file_wb_work);
+	queue_delayed_work(system_unbound_wq, &ex->wb_work,
+		msecs_to_jiffies(writeback_ms));
+
+	return 0;
+}
+
+/* Last writeback before the store goes away, nothing can dirty it now */
+static void blk_example_file_close(blk_example *ex)
+{
+	cancel_delayed_work_sync(&ex->wb_work);
+	if (blk_example_file_writeback(ex) || vfs_fsync(ex->file, 0))
+		pr_warn("%s(): final writeback failed, file is stale\n",
+			__func__);
+	vfree(ex->wb_buf);
+	fput(ex->file);
+	ex->file = NULL;
+}
+
+/* Find the node of the first CPU that maps to default hardware queue idx */
+static int blk_example_hctx_node(struct blk_mq_tag_set *set, unsigned int idx)
+{
+	struct blk_mq_queue_map *map = &set->map[HCTX_TYPE_DEFAULT];
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		if (map->mq_map[cpu] == map->queue_offset + idx)
+			return cpu_to_node(cpu);
+	}
+
+	return first_online_node;
+}
+
+/*
+ * Work out which node each stripe lives on.  The map repeats every
+ * node_map_len stripes: round robin over the online nodes for interleave,
+ * or the node of the hardware queue stripe % submit_queues for hctx mode.
+ * Needs the tag set allocated so the CPU to queue mapping is known.
+ */
+static int blk_example_build_node_map(blk_example *ex)
+{
+	unsigned int i = 0;
+	int node;
+
+	if (ex->numa_mode == BLK_EX_NUMA_NONE)
+		return 0;
+
+	if (ex->numa_mode == BLK_EX_NUMA_INTERLEAVE)
+		ex->node_map_len = num_online_nodes();
+	else
+		ex->node_map_len = ex->submit_queues;
+
+	ex->node_map = kcalloc(ex->node_map_len, sizeof(*ex->node_map),
+		GFP_KERNEL);
+	if (!ex->node_map)
+		return -ENOMEM;
+
+	if (ex->numa_mode == BLK_EX_NUMA_INTERLEAVE) {
+		for_each_online_node(node)
+			ex->node_map[i++] = node;
+	} else {
+		for (i = 0; i < ex->node_map_len; i++)
+			ex->node_map[i] = blk_example_hctx_node(ex->set, i);
+	}
+
+	ex->node_bytes = __alloc_percpu(sizeof(u64) * 2 * nr_node_ids,
+		sizeof(u64));
+	if (!ex->node_bytes) {
+		kfree(ex->node_map);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * One chunk of the flat store.  With huge_store set try for a compound page
+ * first, which the direct map covers with 2M or 1G entries, and fall back to
+ * vmalloc() with 4K pages when memory is too fragmented for one.
+ */
+static void *blk_example_alloc_chunk(blk_example *ex, u64 size, int node)
+{
+	struct page *page;
+
+	if (ex->huge == BLK_EX_HUGE_NONE)
+		return kvzalloc_node(size, GFP_KERNEL, node);
+
+	page = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO | __GFP_COMP |
+		__GFP_NOWARN | __GFP_NORETRY, get_order(size));
+	if (page) {
+		ex->nr_huge_chunks++;
+		return page_address(page);
+	}
+
+	return vzalloc_node(size, node);
+}
+
+static void blk_example_free_chunk(blk_example *ex, unsigned long idx)
+{
+	u64 pos = (u64)idx << ex->chunk_shift;
+	u64 size = min(1ULL << ex->chunk_shift, ex->capacity - pos);
+	void *chunk = ex->chunks[idx];
+
+	if (ex->huge != BLK_EX_HUGE_NONE && !is_vmalloc_addr(chunk))
+		free_pages((unsigned long)chunk, get_order(size));
+	else
+		kvfree(chunk);
+}
+
+/*
+ * DAX, dax_mem=<size>@<start>.  A filesystem mounted with -o dax maps the
+ * store straight into user space, so it has to be memory with struct pages
+ * that the fsdax code can refcount, which vmalloc() or the page allocator
+ * can't give us.  Instead the store is a range of RAM kept from the kernel
+ * at boot (memmap=4G!12G) that memremap_pages() gives ZONE_DEVICE pages.
+ * Block I/O still copies to and from it through the direct map like any
+ * flat store.  The dax_device just hands out addresses and pfns in it.
+ */
+#if IS_ENABLED(CONFIG_FS_DAX)
+static long blk_example_dax_direct_access(struct dax_device *dax_dev,
+	pgoff_t pgoff, long nr_pages, enum dax_access_mode mode, void **kaddr,
+	unsigned long *pfn)
+{
+	blk_example *ex = dax_get_private(dax_dev);
+	u64 off = (u64)pgoff << PAGE_SHIFT;
+
+	if (off >= ex->dax_size)
+		return -EIO;
+
+	if (kaddr)
+		*kaddr = ex->store + off;
+	if (pfn)
+		*pfn = PHYS_PFN(ex->dax_phys + off);
+
+	return min_t(long, nr_pages, (ex->dax_size - off) >> PAGE_SHIFT);
+}
+
+static int blk_example_dax_zero_page_range(struct dax_device *dax_dev,
+	pgoff_t pgoff, size_t nr_pages)
+{
+	blk_example *ex = dax_get_private(dax_dev);
+	u64 pos = (u64)pgoff << PAGE_SHIFT;
+	u64 len = (u64)nr_pages << PAGE_SHIFT;
+
+	blk_example_lock_range(ex, pos, len, true);
+	memset(ex->store + pos, 0, len);
+	blk_example_unlock_range(ex, pos, len, true);
+
+	return 0;
+}
+
+static const struct dax_operations blk_example_dax_ops = {
+	.direct_access = blk_example_dax_direct_access,
+	.zero_page_range = blk_example_dax_zero_page_range,
+};
+
+/* Claim the reserved range and give it struct pages, it becomes ex->store */
+static int blk_example_dax_map(blk_example *ex)
+{
+	void *addr;
+
+	if (ex->sparse || ex->zoned || ex->numa_mode || ex->huge) {
+		pr_warn("%s(): dax_mem can't be used with sparse, zoned, numa_mode or huge_store\n",
+			__func__);
+		return -EINVAL;
+	}
+
+	if (!request_mem_region(ex->dax_phys, ex->dax_size, DRV_NAME)) {
+		pr_warn("%s(): %pa+%llx is busy\n", __func__, &ex->dax_phys,
+			ex->dax_size);
+		return -EBUSY;
+	}
+
+	memset(&ex->pgmap, 0, sizeof(ex->pgmap));
+	ex->pgmap.type = MEMORY_DEVICE_FS_DAX;
+	ex->pgmap.range.start = ex->dax_phys;
+	ex->pgmap.range.end = ex->dax_phys + ex->dax_size - 1;
+	ex->pgmap.nr_range = 1;
+	addr = memremap_pages(&ex->pgmap, NUMA_NO_NODE);
+	if (IS_ERR(addr)) {
+		release_mem_region(ex->dax_phys, ex->dax_size);
+		pr_warn("%s(): memremap_pages() failed rc=%ld\n", __func__,
+			PTR_ERR(addr));
+		return PTR_ERR(addr);
+	}
+
+	/* Whatever the last user left behind, a new disk reads as zeros */
+	memset(addr, 0, ex->dax_size);
+	ex->store = addr;
+	return 0;
+}
+
+static void blk_example_dax_unmap(blk_example *ex)
+{
+	memunmap_pages(&ex->pgmap);
+	release_mem_region(ex->dax_phys, ex->dax_size);
+	ex->store = NULL;
+}
+
+/* Let filesystems on the disk find its dax_device, before add_disk() */
+static int blk_example_dax_register(blk_example *ex)
+{
+	struct dax_device *dax_dev;
+	int rc;
+
+	if (!ex->dax_size)
+		return 0;
+
+	dax_dev = alloc_dax(ex, &blk_example_dax_ops);
+	if (IS_ERR(dax_dev))
+		return PTR_ERR(dax_dev);
+
+	/* It's RAM, there is no cache to write back and MAP_SYNC is free */
+	set_dax_synchronous(dax_dev);
+	rc = dax_add_host(dax_dev, ex->disk);
+	if (rc) {
+		kill_dax(dax_dev);
+		put_dax(dax_dev);
+		return rc;
+	}
+
+	ex->dax_dev = dax_dev;
+	return 0;
+}
+
+static void blk_example_dax_unregister(blk_example *ex)
+{
+	if (!ex->dax_dev)
+		return;
+
+	dax_remove_host(ex->disk);
+	kill_dax(ex->dax_dev);
+	put_dax(ex->dax_dev);
+	ex->dax_dev = NULL;
+}
+#else
+static inline int blk_example_dax_map(blk_example *ex)
+{
+	pr_warn("%s(): dax_mem needs CONFIG_FS_DAX\n", __func__);
+	return -EOPNOTSUPP;
+}
+
+static inline void blk_example_dax_unmap(blk_example *ex)
+{
+}
+
+static inline int blk_example_dax_register(blk_example *ex)
+{
+	return 0;
+}
+
+static inline void blk_example_dax_unregister(blk_example *ex)
+{
+}
+#endif
+
+static int blk_example_alloc_store(blk_example *ex)
+{
+	u64 chunk;
+	unsigned long i, nr_chunks;
+	int node = NUMA_NO_NODE;
+	int rc;
+
+	if (ex->compress || ex->backing_path)
+		ex->sparse = true;
+
+	if (ex->dax_size)
+		return blk_example_dax_map(ex);
+
+	rc = blk_example_build_node_map(ex);
+	if (rc)
+		return rc;
+
+	if (ex->sparse) {
+		ex->top = blk_example_layer_alloc(NULL);
+		if (!ex->top) {
+			free_percpu(ex->node_bytes);
+			kfree(ex->node_map);
+			return -ENOMEM;
+		}
+		ex->pages = &ex->top->pages;
+		atomic_long_set(&ex->nr_pages, 0);
+		atomic_long_set(&ex->nr_same, 0);
+		if (ex->compress)
+			rc = blk_example_zstore_init(ex, ex->compress);
+		else if (ex->backing_path)
+			rc = blk_example_file_open(ex, ex->backing_path);
+		if (rc) {
+			kfree(ex->top);
+			free_percpu(ex->node_bytes);
+			kfree(ex->node_map);
+		}
+		return rc;
+	}
+
+	/*
+	 * Huge vmalloc mappings need the arch to support them and quietly
+	 * use 4K pages otherwise.  With numa_mode the store is per-node
+	 * chunks, so huge_store=1 gets compound pages like huge_store=2.
+	 * Either way the store starts out zeroed, or reads of sectors never
+	 * written would hand out stale kernel memory.
+	 */
+	if (ex->numa_mode == BLK_EX_NUMA_NONE &&
+	    ex->huge != BLK_EX_HUGE_PAGES) {
+		if (ex->huge == BLK_EX_HUGE_VMAP)
+			ex->store = vmalloc_huge(ex->capacity,
+				GFP_KERNEL | __GFP_ZERO);
+		else
+			ex->store = vzalloc(ex->capacity);
+		if (!ex->store) {
+			pr_info("%s(): store is NULL\n", __func__);
+			return -ENOMEM;
+		}
+		return 0;
+	}
+
+	/* One chunk per stripe, each on its own node */
+	if (ex->huge != BLK_EX_HUGE_NONE) {
+		ex->chunk_shift = max_t(unsigned int, PMD_SHIFT,
+			ex->stripe_shift);
+	}
+	chunk = 1ULL << ex->chunk_shift;
+	nr_chunks = DIV_ROUND_UP_ULL(ex->capacity, chunk);
+	ex->chunks = kvcalloc(nr_chunks, sizeof(*ex->chunks), GFP_KERNEL);
+	if (!ex->chunks)
+		goto out_free_map;
+
+	ex->nr_huge_chunks = 0;
+	for (i = 0; i < nr_chunks; i++) {
+		u64 pos = (u64)i << ex->chunk_shift;
+
+		if (ex->numa_mode)
+			node = blk_example_stripe_node(ex, pos);
+		ex->chunks[i] = blk_example_alloc_chunk(ex,
+			min(chunk, ex->capacity - pos), node);
+		if (!ex->chunks[i])
+			goto out_free_chunks;
+		cond_resched();
+	}
+	ex->nr_chunks = nr_chunks;
+
+	if (ex->huge != BLK_EX_HUGE_NONE && ex->nr_huge_chunks < nr_chunks)
+		pr_info("%s(): %lu of %lu chunks fell back to 4K pages\n",
+			__func__, nr_chunks - ex->nr_huge_chunks, nr_chunks);
+
+	return 0;
+
+out_free_chunks:
+	while (i--)
+		blk_example_free_chunk(ex, i);
+	kvfree(ex->chunks);
+	ex->chunks = NULL;
+out_free_map:
+	free_percpu(ex->node_bytes);
+	kfree(ex->node_map);
+	pr_info("%s(): store is NULL\n", __func__);
+	return -ENOMEM;
+}
+
+static void blk_example_free_store(blk_example *ex)
+{
+	unsigned long idx;
+	void *entry;
+
+	if (ex->file)
+		blk_example_file_close(ex);
+
+	if (ex->sparse) {
+		xa_for_each(ex->pages, idx, entry)
+			blk_example_store_free_entry(ex, entry);
+		xa_destroy(ex->pages);
+		blk_example_layer_put(ex->top->parent);
+		kfree(ex->top);
+		ex->top = NULL;
+		if (ex->compressed)
+			blk_example_zstore_exit(ex);
+	} else if (ex->dax_size) {
+		blk_example_dax_unmap(ex);
+	} else if (ex->chunks) {
+		for (idx = 0; idx < ex->nr_chunks; idx++)
+			blk_example_free_chunk(ex, idx);
+		kvfree(ex->chunks);
+		ex->chunks = NULL;
+	} else {
+		vfree(ex->store);
+		ex->store = NULL;
+	}
+
+	free_percpu(ex->node_bytes);
+	kfree(ex->node_map);
+	ex->node_bytes = NULL;
+	ex->node_map = NULL;
+}
+
+static int blk_example_store_show(struct seq_file *m, void *unused)
+{
+	blk_example *ex = m->private;
+
+	seq_printf(m, "mode %s\n", ex->file ? "file" :
+		ex->compressed ? "compressed" : ex->sparse ? "sparse" :
+		ex->dax_size ? "dax" : "flat");
+	seq_printf(m, "capacity_bytes %llu\n", ex->capacity);
+	if (ex->compressed) {
+		blk_example_zstore_show(m, ex);
+	} else if (ex->sparse) {
+		long pages = atomic_long_read(&ex->nr_pages);
+
+		seq_printf(m, "allocated_pages %ld\n", pages);
+		seq_printf(m, "allocated_bytes %llu\n", (u64)pages << PAGE_SHIFT);
+		if (ex->top->parent) {
+			blk_example_layer *layer;
+			long shared = 0;
+
+			for (layer = ex->top->parent; layer;
+			     layer = layer->parent)
+				shared += layer->nr_pages;
+			seq_printf(m, "shared_pages %ld\n", shared);
+		}
+		if (ex->file) {
+			seq_printf(m, "zero_pages %ld\n",
+				atomic_long_read(&ex->nr_same));
+			seq_printf(m, "file_loads %ld\n",
+				atomic_long_read(&ex->file_loads));
+			seq_printf(m, "file_pages_written %ld\n",
+				atomic_long_read(&ex->file_written));
+			seq_printf(m, "file_flushes %ld\n",
+				atomic_long_read(&ex->file_flushes));
+		}
+	} else {
+		seq_printf(m, "allocated_bytes %llu\n", ex->capacity);
+		seq_printf(m, "huge_store %u\n", ex->huge);
+		if (ex->chunks && ex->huge != BLK_EX_HUGE_NONE)
+			seq_printf(m, "huge_chunks %lu of %lu\n",
+				ex->nr_huge_chunks, ex->nr_chunks);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(blk_example_store);
+
+/* Bytes copied per node, split by whether the copying CPU was local */
+static int blk_example_numa_show(struct seq_file *m, void *unused)
+{
+	blk_example *ex = m->private;
+	unsigned int i;
+	int node, cpu;
+
+	seq_printf(m, "numa_mode %u\n", ex->numa_mode);
+	if (ex->numa_mode == BLK_EX_NUMA_NONE)
+		return 0;
+
+	seq_puts(m, "stripe_map");
+	for (i = 0; i < ex->node_map_len; i++)
+		seq_printf(m, " %d", ex->node_map[i]);
+	seq_puts(m, "\n");
+
+	seq_puts(m, "node local_bytes remote_bytes\n");
+	for_each_online_node(node) {
+		u64 local = 0, remote = 0;
+
+		for_each_possible_cpu(cpu) {
+			u64 *nb = per_cpu_ptr(ex->node_bytes, cpu);
+
+			local += nb[node * 2];
+			remote += nb[node * 2 + 1];
+		}
+		seq_printf(m, "%d %llu %llu\n", node, local, remote);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(blk_example_numa);
+
+/*
+ * Protection information, pi_type=<1|2|3>.  The disk registers a T10 DIF
+ * integrity profile with an 8 byte tuple for every 512 byte sector and keeps
+ * the tuples in ex->pi, next to the store and under the same stripe locks.
+ * Every tuple that comes with a write is checked before anything is stored,
+ * the guard against the data and for type 1 and 2 the reference tag against
+ * the sector, so one bad tuple fails the whole request with
+ * BLK_STS_PROTECTION and leaves the disk as it was.  A read hands back the
+ * saved tuples.  Sectors never written, or discarded since, hold escape tags
+ * and a read generates fresh PI for them from the data.  A write that comes
+ * without PI (write_generate turned off) gets PI generated by us as well,
+ * like a real drive would.  The T10 CRC is crc_t10dif(), which the kernel
+ * accelerates with carry-less multiply where the CPU has it.
+ */
+#if IS_ENABLED(CONFIG_BLK_DEV_INTEGRITY)
+typedef blk_status_t (*blk_example_pi_fn)(blk_example *ex,
+	struct bio_integrity_payload *bip, void *data,
+	struct t10_pi_tuple *pi, sector_t sector);
+
+static inline __be16 blk_example_pi_csum(blk_example *ex, const void *data)
+{
+	if (ex->pi_csum == BLK_INTEGRITY_CSUM_IP)
+		return (__force __be16)ip_compute_csum(data, SECTOR_SIZE);
+	return cpu_to_be16(crc_t10dif(data, SECTOR_SIZE));
+}
+
+/* What blk_example_pi_clear() leaves behind */
+static inline bool blk_example_pi_unwritten(const struct t10_pi_tuple *pi)
+{
+	return pi->app_tag == T10_PI_APP_ESCAPE &&
+		pi->ref_tag == T10_PI_REF_ESCAPE;
+}
+
+static inline void blk_example_pi_generate(blk_example *ex,
+	struct t10_pi_tuple *pi, const void *data, sector_t sector)
+{
+	pi->guard_tag = blk_example_pi_csum(ex, data);
+	pi->app_tag = 0;
+	pi->ref_tag = cpu_to_be32(lower_32_bits(sector));
+	this_cpu_inc(ex->pi_stats->generated);
+}
+
+/*
+ * Call fn for every sector of rq with its data and, if the request carries
+ * PI, its tuple.  Buffers are at least sector aligned so neither a sector nor
+ * a tuple ever straddles a page.
+ */
+static blk_status_t blk_example_pi_walk(struct request *rq,
+	blk_example_pi_fn fn)
+{
+	blk_example *ex = rq->q->queuedata;
+	sector_t sector = blk_rq_pos(rq);
+	blk_status_t status = BLK_STS_OK;
+	struct bio *bio;
+
+	__rq_for_each_bio(bio, rq) {
+		struct bio_integrity_payload *bip = bio_integrity(bio);
+		struct bvec_iter iter, pi_iter = { };
+		struct bio_vec bv, pv;
+		unsigned int off;
+
+		if (bip)
+			pi_iter = bip->bip_iter;
+
+		bio_for_each_segment(bv, bio, iter) {
+			void *data = bvec_kmap_local(&bv);
+
+			for (off = 0; off < bv.bv_len; off += SECTOR_SIZE) {
+				struct t10_pi_tuple *pi = NULL;
+
+				if (bip) {
+					pv = bvec_iter_bvec(bip->bip_vec,
+						pi_iter);
+					pi = bvec_kmap_local(&pv);
+				}
+				status = fn(ex, bip, data + off, pi, sector++);
+				if (pi) {
+					kunmap_local(pi);
+					bvec_iter_advance(bip->bip_vec,
+						&pi_iter, sizeof(*pi));
+				}
+				if (status)
+					break;
+			}
+			kunmap_local(data);
+			if (status)
+				return status;
+		}
+	}
+
+	return BLK_STS_OK;
+}
+
+/* Check one tuple of a write the way the block layer would on a read */
+static blk_status_t blk_example_pi_verify(blk_example *ex,
+	struct bio_integrity_payload *bip, void *data,
+	struct t10_pi_tuple *pi, sector_t sector)
+{
+	__be16 csum;
+
+	if (ex->pi_type == 3 ? blk_example_pi_unwritten(pi) :
+	    pi->app_tag == T10_PI_APP_ESCAPE)
+		return BLK_STS_OK;
+
+	if ((bip->bip_flags & BIP_CHECK_REFTAG) && ex->pi_type != 3 &&
+	    be32_to_cpu(pi->ref_tag) != lower_32_bits(sector)) {
+		this_cpu_inc(ex->pi_stats->ref_err);
+		pr_err_ratelimited("%s: ref tag error at sector %llu (rcvd %u)\n",
+			ex->name, (u64)sector, be32_to_cpu(pi->ref_tag));
+		return BLK_STS_PROTECTION;
+	}
+
+	if (bip->bip_flags & BIP_CHECK_GUARD) {
+		csum = blk_example_pi_csum(ex, data);
+		if (pi->guard_tag != csum) {
+			this_cpu_inc(ex->pi_stats->guard_err);
+			pr_err_ratelimited("%s: guard tag error at sector %llu (rcvd %04x, want %04x)\n",
+				ex->name, (u64)sector,
+				be16_to_cpu(pi->guard_tag), be16_to_cpu(csum));
+			return BLK_STS_PROTECTION;
+		}
+	}
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t blk_example_pi_save(blk_example *ex,
+	struct bio_integrity_payload *bip, void *data,
+	struct t10_pi_tuple *pi, sector_t sector)
+{
+	if (pi)
+		ex->pi[sector] = *pi;
+	else
+		blk_example_pi_generate(ex, &ex->pi[sector], data, sector);
+
+	return BLK_STS_OK;
+}
+
+static blk_status_t blk_example_pi_load(blk_example *ex,
+	struct bio_integrity_payload *bip, void *data,
+	struct t10_pi_tuple *pi, sector_t sector)
+{
+	if (blk_example_pi_unwritten(&ex->pi[sector]))
+		blk_example_pi_generate(ex, pi, data, sector);
+	else
+		*pi = ex->pi[sector];
+
+	return BLK_STS_OK;
+}
+
+static inline void blk_example_pi_account(struct request *rq, bool write,
+	u64 start)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_pi_stats *ps;
+
+	ps = get_cpu_ptr(ex->pi_stats);
+	ps->bytes[write] += blk_rq_bytes(rq);
+	ps->ns[write] += ktime_get_ns() - start;
+	put_cpu_ptr(ex->pi_stats);
+}
+
+/*
+ * Check and save the PI of a write before its data is copied, caller holds
+ * the stripe locks.
+ */
+static blk_status_t blk_example_pi_write(struct request *rq)
+{
+	u64 start = ktime_get_ns();
+	blk_status_t status = BLK_STS_OK;
+
+	if (blk_integrity_rq(rq))
+		status = blk_example_pi_walk(rq, blk_example_pi_verify);
+	if (!status)
+		status = blk_example_pi_walk(rq, blk_example_pi_save);
+
+	blk_example_pi_account(rq, true, start);
+	return status;
+}
+
+/* Fill in the PI of a read once its data is copied */
+static blk_status_t blk_example_pi_read(struct request *rq)
+{
+	u64 start = ktime_get_ns();
+	blk_status_t status;
+
+	if (!blk_integrity_rq(rq))
+		return BLK_STS_OK;
+
+	status = blk_example_pi_walk(rq, blk_example_pi_load);
+	blk_example_pi_account(rq, false, start);
+	return status;
+}
+
+/* Forget the PI of [pos, pos + len), caller holds the stripe locks */
+static inline void blk_example_pi_clear(blk_example *ex, u64 pos, u64 len)
+{
+	if (ex->pi)
+		memset(&ex->pi[pos >> SECTOR_SHIFT], 0xff,
+			(len >> SECTOR_SHIFT) * sizeof(*ex->pi));
+}
+
+static void blk_example_pi_exit(blk_example *ex)
+{
+	vfree(ex->pi);
+	free_percpu(ex->pi_stats);
+	ex->pi = NULL;
+	ex->pi_stats = NULL;
+}
+
+static int blk_example_pi_init(blk_example *ex)
+{
+	u64 nr = ex->capacity >> SECTOR_SHIFT;
+
+	if (!ex->pi_type)
+		return 0;
+
+	/* DAX writes never come through us to have their PI updated */
+	if (ex->sparse || ex->zoned || ex->dax_size) {
+		pr_warn("%s(): pi_type needs the flat store without dax_mem\n",
+			__func__);
+		return -EINVAL;
+	}
+
+	ex->pi = vmalloc_array(nr, sizeof(*ex->pi));
+	ex->pi_stats = alloc_percpu(blk_example_pi_stats);
+	if (!ex->pi || !ex->pi_stats) {
+		blk_example_pi_exit(ex);
+		return -ENOMEM;
+	}
+	memset(ex->pi, 0xff, nr * sizeof(*ex->pi));
+
+	return 0;
+}
+#else
+static inline blk_status_t blk_example_pi_write(struct request *rq)
+{
+	return BLK_STS_NOTSUPP;
+}
+
+static inline blk_status_t blk_example_pi_read(struct request *rq)
+{
+	return BLK_STS_NOTSUPP;
+}
+
+static inline void blk_example_pi_clear(blk_example *ex, u64 pos, u64 len)
+{
+}
+
+static inline void blk_example_pi_exit(blk_example *ex)
+{
+}
+
+static inline int blk_example_pi_init(blk_example *ex)
+{
+	if (!ex->pi_type)
+		return 0;
+
+	pr_warn("%s(): pi_type needs CONFIG_BLK_DEV_INTEGRITY\n", __func__);
+	return -EOPNOTSUPP;
+}
+#endif
+
+/* CPU time spent on PI per GiB of data, and any tuples that didn't check out */
+static int blk_example_integrity_show(struct seq_file *m, void *unused)
+{
+	static const char * const names[2] = { "read", "write" };
+	blk_example *ex = m->private;
+	blk_example_pi_stats sum = { };
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		blk_example_pi_stats *ps = per_cpu_ptr(ex->pi_stats, cpu);
+
+		for (i = 0; i < 2; i++) {
+			sum.bytes[i] += ps->bytes[i];
+			sum.ns[i] += ps->ns[i];
+		}
+		sum.generated += ps->generated;
+		sum.guard_err += ps->guard_err;
+		sum.ref_err += ps->ref_err;
+	}
+
+	seq_printf(m, "pi_type %u guard %s\n", ex->pi_type,
+		ex->pi_csum == BLK_INTEGRITY_CSUM_IP ? "ip" : "crc");
+	for (i = 0; i < 2; i++)
+		seq_printf(m, "%s bytes %llu ns %llu ns_per_gib %llu\n",
+			names[i], sum.bytes[i], sum.ns[i], sum.bytes[i] ?
+			mul_u64_u64_div_u64(sum.ns[i], SZ_1G, sum.bytes[i]) : 0);
+	seq_printf(m, "generated %llu\n", sum.generated);
+	seq_printf(m, "guard_errors %llu ref_errors %llu\n", sum.guard_err,
+		sum.ref_err);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(blk_example_integrity);
+
+/*
+ * Get the sparse store ready for rq before the stripe locks are taken, since
+ * nothing can sleep once they're held.  No data is copied here: pages a
+ * request needs are faulted in from backing_file, and for a write every page
+ * it covers is allocated up front.  can_sleep says whether we may block
+ * doing that; if not, anything that would block returns BLK_STS_RESOURCE.
+ */
+static blk_status_t blk_example_rw_prepare(struct request *rq, bool can_sleep)
+{
+	blk_example *ex = rq->q->queuedata;
+	u64 pos = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+	bool write = op_is_write(req_op(rq));
+	blk_status_t status;
+
+	if (!ex->sparse || !blk_rq_bytes(rq))
+		return BLK_STS_OK;
+
+	if (ex->file) {
+		status = blk_example_file_fault(ex, pos, blk_rq_bytes(rq),
+			write, can_sleep);
+		if (status)
+			return status;
+	}
+
+	if (!write)
+		return BLK_STS_OK;
+
+	return blk_example_store_prealloc(ex, pos, blk_rq_bytes(rq),
+		can_sleep ? GFP_NOIO : GFP_NOWAIT);
+}
+
+/*
+ * Copy the data for a read or write, caller holds the stripe locks.
+ *
+ * Without highmem every page is in the direct map, so we walk whole
+ * multi-page bio_vecs and copy each with as few memcpy() calls as the store
+ * layout allows, rather than mapping and copying one page at a time.
+ *
+ * Writes of at least nt_threshold bytes are streamed into the store with
+ * non-temporal stores.  Whoever reads them next is some later request, not
+ * the submitter, so there's no point keeping them in the cache.  Reads are
+ * copied into the submitter's buffer, which it's about to use, so they
+ * always go through the cache.
+ */
+static blk_status_t blk_example_rw_copy(struct request *rq)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	u64 pos = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+	bool write = op_is_write(req_op(rq));
+	unsigned int threshold = READ_ONCE(nt_threshold);
+	blk_status_t status = BLK_STS_OK;
+	void *page_addr;
+
+	/* Bad PI fails the write before it changes anything */
+	if (ex->pi && write) {
+		status = blk_example_pi_write(rq);
+		if (status)
+			return status;
+	}
+
+	cmd->nt = write && threshold && blk_rq_bytes(rq) >= threshold &&
+		!ex->compressed;
+
+	if (!IS_ENABLED(CONFIG_HIGHMEM)) {
+		rq_for_each_bvec(bvec, rq, iter) {
+			if (write)
+				status = blk_example_store_write(ex, pos,
+					bvec_virt(&bvec), bvec.bv_len, cmd->nt);
+			else
+				status = blk_example_store_read(ex, pos,
+					bvec_virt(&bvec), bvec.bv_len);
+			if (status)
+				break;
+			pos += bvec.bv_len;
+		}
+		goto out;
+	}
+
+	rq_for_each_segment(bvec, rq, iter) {
+		/* Get memory of address to use in memcpy */
+		page_addr = kmap_atomic(bvec.bv_page);
+
+		/* Adjust page address based on offset in bio_vec */
+		page_addr = page_addr + bvec.bv_offset;
+		if (write)
+			status = blk_example_store_write(ex, pos, page_addr,
+				bvec.bv_len, cmd->nt);
+		else
+			status = blk_example_store_read(ex, pos, page_addr,
+				bvec.bv_len);
+		kunmap_atomic(page_addr);
+		if (status)
+			break;
+
+		/* Update the position in the store based on the length */
+		pos += bvec.bv_len;
+	}
+
+out:
+	/* Non-temporal stores aren't ordered, fence before the unlock */
+	if (cmd->nt)
+		wmb();
+	if (ex->pi && !write && !status)
+		status = blk_example_pi_read(rq);
+	return status;
+}
+
+/*
+ * Do the real work of processing the bio_vec's in the request to copy data
+ * to/from the backing memory store.  can_sleep says whether we're allowed to
+ * block allocating sparse store pages.
+ */
+static blk_status_t blk_example_rw(struct request *rq, bool can_sleep)
+{
+	blk_example *ex = rq->q->queuedata;
+	u64 start = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+	unsigned int len = blk_rq_bytes(rq);
+	bool write = op_is_write(req_op(rq));
+	unsigned int tries = 0;
+	blk_status_t status;
+
+	if (!len)
+		return BLK_STS_OK;
+
+	status = blk_example_rw_prepare(rq, can_sleep);
+	if (status)
+		return status;
+
+retry:
+	blk_example_lock_range(ex, start, len, write);
+	status = blk_example_rw_copy(rq);
+	blk_example_unlock_range(ex, start, len, write);
+
+	/*
+	 * The compressed store can only allocate atomically under the stripe
+	 * locks.  Redoing the whole write is harmless, so if we're allowed to
+	 * sleep give reclaim a moment and try again, but only so many times
+	 * before failing the request.
+	 */
+	if (status == BLK_STS_RESOURCE && ex->compressed && can_sleep &&
+	    ++tries < BLK_EX_ALLOC_RETRIES) {
+		memalloc_retry_wait(GFP_NOIO);
+		goto retry;
+	}
+
+	return status;
+}
+
+/*
+ * Zero [pos, pos + len) of the store, which in the sparse store means freeing
+ * pages.  This can cover gigabytes so we go one stripe at a time rather than
+ * holding every stripe lock for the whole range.
+ */
+static blk_status_t blk_example_discard_range(blk_example *ex, u64 pos,
+	u64 len, bool can_sleep)
+{
+	u64 end = pos + len;
+	u64 stripe = 1ULL << ex->stripe_shift;
+	unsigned int tries = 0;
+	blk_status_t status;
+
+	while (pos < end) {
+		len = min(end, round_down(pos, stripe) + stripe) - pos;
+
+		blk_example_lock_range(ex, pos, len, true);
+		status = blk_example_store_discard(ex, pos, len);
+		if (!status)
+			blk_example_pi_clear(ex, pos, len);
+		blk_example_unlock_range(ex, pos, len, true);
+
+		/* Only a compressed partial page can fail, see blk_example_rw() */
+		if (status == BLK_STS_RESOURCE && can_sleep &&
+		    ++tries < BLK_EX_ALLOC_RETRIES) {
+			memalloc_retry_wait(GFP_NOIO);
+			continue;
+		}
+		if (status)
+			return status;
+
+		tries = 0;
+		pos += len;
+		if (can_sleep)
+			cond_resched();
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Discard with a backing file.  Partial pages at the ends are loaded so they
+ * can be zeroed in place and written back.  Whole pages are dropped from
+ * memory and punched out of the file, or overwritten with zeros if the
+ * filesystem can't punch holes.
+ */
+static blk_status_t blk_example_file_discard(blk_example *ex, u64 pos,
+	u64 len, bool can_sleep)
+{
+	u64 start = round_up(pos, PAGE_SIZE);
+	u64 end = round_down(pos + len, PAGE_SIZE);
+	blk_status_t status;
+	unsigned int noio;
+	int rc = 0;
+
+	status = blk_example_file_fault(ex, pos, len, true, can_sleep);
+	if (status)
+		return status;
+
+	mutex_lock(&ex->file_lock);
+	if (start < end) {
+		noio = memalloc_noio_save();
+		rc = vfs_fallocate(ex->file,
+			FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			start, end - start);
+		if (rc)
+			rc = blk_example_file_zero(ex, start, end);
+		memalloc_noio_restore(noio);
+	}
+	if (!rc)
+		status = blk_example_discard_range(ex, pos, len, can_sleep);
+	mutex_unlock(&ex->file_lock);
+
+	return rc ? BLK_STS_IOERR : status;
+}
+
+/* Discard and write zeroes both just leave zeros behind */
+static blk_status_t blk_example_discard(struct request *rq, bool can_sleep)
+{
+	blk_example *ex = rq->q->queuedata;
+	u64 pos = (u64)blk_rq_pos(rq) << SECTOR_SHIFT;
+
+	if (ex->file)
+		return blk_example_file_discard(ex, pos, blk_rq_bytes(rq),
+			can_sleep);
+
+	return blk_example_discard_range(ex, pos, blk_rq_bytes(rq), can_sleep);
+}
+
+/*
+ * Zoned mode.  Each zone has its own spinlock protecting its write pointer and
+ * condition, so writes to different zones never contend.  A write to a
+ * sequential zone is checked and copied with the zone lock held so the write
+ * pointer only moves once the data is in the store.  There are no open or
+ * active zone limits.
+ */
+static inline blk_example_zone *blk_example_zone_of(blk_example *ex,
+	sector_t sector)
+{
+	return &ex->zones[sector >> ex->zone_shift];
+}
+
+static int blk_example_init_zones(blk_example *ex)
+{
+	sector_t zone_sectors = 1ULL << ex->zone_shift;
+	sector_t sector = 0;
+	unsigned int i;
+
+	ex->nr_zones = ex->capacity >> (ex->zone_shift + SECTOR_SHIFT);
+	ex->zones = kvcalloc(ex->nr_zones, sizeof(*ex->zones), GFP_KERNEL);
+	if (!ex->zones)
+		return -ENOMEM;
+
+	for (i = 0; i < ex->nr_zones; i++) {
+		blk_example_zone *zone = &ex->zones[i];
+
+		spin_lock_init(&zone->lock);
+		zone->start = sector;
+		zone->len = zone_sectors;
+		if (i < zone_nr_conv) {
+			zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+			zone->cond = BLK_ZONE_COND_NOT_WP;
+			zone->wp = (sector_t)-1;
+		} else {
+			zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+			zone->cond = BLK_ZONE_COND_EMPTY;
+			zone->wp = sector;
+		}
+		sector += zone_sectors;
+	}
+
+	return 0;
+}
+
+static int blk_example_report_zones(struct gendisk *disk, sector_t sector,
+	unsigned int nr_zones, report_zones_cb cb, void *data)
+{
+	blk_example *ex = disk->private_data;
+	unsigned int first = sector >> ex->zone_shift;
+	struct blk_zone blkz;
+	unsigned int i;
+	int rc;
+
+	if (first >= ex->nr_zones)
+		return 0;
+	nr_zones = min(nr_zones, ex->nr_zones - first);
+
+	for (i = 0; i < nr_zones; i++) {
+		blk_example_zone *zone = &ex->zones[first + i];
+
+		memset(&blkz, 0, sizeof(blkz));
+		spin_lock(&zone->lock);
+		blkz.start = zone->start;
+		blkz.len = zone->len;
+		blkz.capacity = zone->len;
+		blkz.wp = zone->wp;
+		blkz.type = zone->type;
+		blkz.cond = zone->cond;
+		spin_unlock(&zone->lock);
+
+		rc = cb(&blkz, i, data);
+		if (rc)
+			return rc;
+	}
+
+	return nr_zones;
+}
+
+/*
+ * Write or zone append.  Appends are turned into a write at the zone's write
+ * pointer and rq->__sector is updated so the block layer reports where the
+ * data landed.  Store pages normally have to be allocated with the zone lock
+ * held, if that fails and we can sleep we drop the lock, allocate and retry.
+ */
+static blk_status_t blk_example_zone_write(struct request *rq, bool can_sleep)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_zone *zone = blk_example_zone_of(ex, blk_rq_pos(rq));
+	bool append = req_op(rq) == REQ_OP_ZONE_APPEND;
+	unsigned int nr_sectors = blk_rq_sectors(rq);
+	blk_status_t status;
+	sector_t sector;
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		if (append)
+			return BLK_STS_IOERR;
+		return blk_example_rw(rq, can_sleep);
+	}
+
+	/* Plain writes know where they're going so get the pages up front */
+	if (!append) {
+		status = blk_example_rw_prepare(rq, can_sleep);
+		if (status)
+			return status;
+	}
+
+retry:
+	spin_lock(&zone->lock);
+	if (zone->resetting || zone->cond == BLK_ZONE_COND_FULL ||
+	    zone->wp + nr_sectors > zone->start + zone->len) {
+		status = BLK_STS_IOERR;
+		goto out_unlock;
+	}
+
+	if (append) {
+		sector = zone->wp;
+		rq->__sector = sector;
+		status = blk_example_rw_prepare(rq, false);
+		if (status == BLK_STS_RESOURCE && can_sleep) {
+			spin_unlock(&zone->lock);
+			status = blk_example_store_prealloc(ex,
+				(u64)sector << SECTOR_SHIFT, blk_rq_bytes(rq),
+				GFP_NOIO);
+			if (status)
+				return status;
+			goto retry;
+		}
+		if (status)
+			goto out_unlock;
+	} else if (blk_rq_pos(rq) != zone->wp) {
+		status = BLK_STS_IOERR;
+		goto out_unlock;
+	}
+
+	if (zone->cond == BLK_ZONE_COND_EMPTY ||
+	    zone->cond == BLK_ZONE_COND_CLOSED)
+		zone->cond = BLK_ZONE_COND_IMP_OPEN;
+
+	status = blk_example_rw(rq, false);
+	if (status)
+		goto out_unlock;
+
+	zone->wp += nr_sectors;
+	if (zone->wp == zone->start + zone->len)
+		zone->cond = BLK_ZONE_COND_FULL;
+
+out_unlock:
+	spin_unlock(&zone->lock);
+	return status;
+}
+
+/*
+ * Reset a zone.  Zeroing up to a whole zone of flat store (or freeing it with
+ * sparse=1) is far too long to do under the zone spinlock, so the zone is
+ * marked as resetting, which fails writes to it, and the discard runs with
+ * the lock dropped.
+ */
+static blk_status_t blk_example_zone_reset(blk_example *ex,
+	blk_example_zone *zone, bool can_sleep)
+{
+	blk_status_t status;
+
+	spin_lock(&zone->lock);
+	if (zone->cond == BLK_ZONE_COND_EMPTY && !zone->resetting) {
+		spin_unlock(&zone->lock);
+		return BLK_STS_OK;
+	}
+	zone->resetting++;
+	spin_unlock(&zone->lock);
+
+	status = blk_example_discard_range(ex, (u64)zone->start << SECTOR_SHIFT,
+		(u64)zone->len << SECTOR_SHIFT, can_sleep);
+
+	spin_lock(&zone->lock);
+	if (!status) {
+		zone->cond = BLK_ZONE_COND_EMPTY;
+		zone->wp = zone->start;
+	}
+	zone->resetting--;
+	spin_unlock(&zone->lock);
+
+	return status;
+}
+
+/*
+ * Zone management.  Resets only ever get here where we can sleep, see
+ * blk_example_queue_rq().
+ */
+static blk_status_t blk_example_zone_mgmt(struct request *rq, bool can_sleep)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_zone *zone;
+	blk_status_t status = BLK_STS_OK;
+	unsigned int i;
+
+	if (req_op(rq) == REQ_OP_ZONE_RESET_ALL) {
+		for (i = 0; i < ex->nr_zones; i++) {
+			zone = &ex->zones[i];
+			if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+				continue;
+			status = blk_example_zone_reset(ex, zone, can_sleep);
+			if (status)
+				return status;
+			if (can_sleep)
+				cond_resched();
+		}
+		return BLK_STS_OK;
+	}
+
+	zone = blk_example_zone_of(ex, blk_rq_pos(rq));
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL)
+		return BLK_STS_IOERR;
+
+	if (req_op(rq) == REQ_OP_ZONE_RESET)
+		return blk_example_zone_reset(ex, zone, can_sleep);
+
+	spin_lock(&zone->lock);
+	if (zone->resetting) {
+		spin_unlock(&zone->lock);
+		return BLK_STS_IOERR;
+	}
+	switch (req_op(rq)) {
+	case REQ_OP_ZONE_OPEN:
+		if (zone->cond == BLK_ZONE_COND_FULL)
+			status = BLK_STS_IOERR;
+		else
+			zone->cond = BLK_ZONE_COND_EXP_OPEN;
+		break;
+	case REQ_OP_ZONE_CLOSE:
+		if (zone->cond == BLK_ZONE_COND_IMP_OPEN ||
+		    zone->cond == BLK_ZONE_COND_EXP_OPEN)
+			zone->cond = zone->wp == zone->start ?
+				BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED;
+		else if (zone->cond != BLK_ZONE_COND_CLOSED)
+			status = BLK_STS_IOERR;
+		break;
+	case REQ_OP_ZONE_FINISH:
+		zone->cond = BLK_ZONE_COND_FULL;
+		zone->wp = zone->start + zone->len;
+		break;
+	default:
+		status = BLK_STS_NOTSUPP;
+		break;
+	}
+	spin_unlock(&zone->lock);
+
+	return status;
+}
+
+/* Process a request based on what operation it is */
+static blk_status_t blk_example_transfer(struct request *rq, bool can_sleep)
+{
+	blk_example *ex = rq->q->queuedata;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		return blk_example_rw(rq, can_sleep);
+	case REQ_OP_WRITE:
+		if (ex->zoned)
+			return blk_example_zone_write(rq, can_sleep);
+		return blk_example_rw(rq, can_sleep);
+	case REQ_OP_ZONE_APPEND:
+		return blk_example_zone_write(rq, can_sleep);
+	case REQ_OP_ZONE_OPEN:
+	case REQ_OP_ZONE_CLOSE:
+	case REQ_OP_ZONE_FINISH:
+	case REQ_OP_ZONE_RESET:
+	case REQ_OP_ZONE_RESET_ALL:
+		return blk_example_zone_mgmt(rq, can_sleep);
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		return blk_example_discard(rq, can_sleep);
+	case REQ_OP_FLUSH:
+		/* Only a backing file can be behind, memory is always current */
+		if (ex->file)
+			return blk_example_file_flush(ex);
+		return BLK_STS_OK;
+	default:
+		return BLK_STS_NOTSUPP;
+	}
+}
+
+/*
+ * I/O statistics.  Each hardware queue has per-CPU counters so the hot path
+ * is a couple of plain increments with preemption disabled, no atomics or
+ * shared cache lines.  Latencies are split into queue_rq() to the point we
+ * finish with the request (q2c) and from there to blk_mq_end_request() (c2e),
+ * the latter being the cost of getting the completion back to the submitter.
+ */
+static const char * const blk_example_stat_names[BLK_EX_NR_STAT_OPS] = {
+	"read", "write", "discard", "flush",
+};
+
+static inline unsigned int blk_example_stat_op(struct request *rq)
+{
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		return BLK_EX_STAT_READ;
+	case REQ_OP_WRITE:
+	case REQ_OP_ZONE_APPEND:
+		return BLK_EX_STAT_WRITE;
+	case REQ_OP_FLUSH:
+		return BLK_EX_STAT_FLUSH;
+	default:
+		return BLK_EX_STAT_DISCARD;
+	}
+}
+
+static inline unsigned int blk_example_hist_bucket(u64 ns)
+{
+	unsigned int b;
+
+	if (ns < (1ULL << BLK_EX_HIST_SHIFT))
+		return 0;
+
+	b = fls64(ns) - BLK_EX_HIST_SHIFT;
+	return min_t(unsigned int, b, BLK_EX_HIST_BUCKETS - 1);
+}
+
+static inline void blk_example_mark_queued(blk_example_cmd *cmd)
+{
+	if (stats)
+		cmd->queue_ns = ktime_get_ns();
+}
+
+static inline void blk_example_mark_complete(blk_example_cmd *cmd)
+{
+	if (stats)
+		cmd->complete_ns = ktime_get_ns();
+}
+
+/* Status to end the request with, .timeout may have given up on it */
+static inline blk_status_t blk_example_cmd_status(blk_example_cmd *cmd)
+{
+	if (READ_ONCE(cmd->timed_out))
+		return BLK_STS_TIMEOUT;
+	return cmd->status;
+}
+
+/* Called just before the request is handed back to the block layer */
+static inline void blk_example_account(struct request *rq)
+{
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	blk_example_queue *bq = rq->mq_hctx->driver_data;
+	blk_example_stats *st;
+	unsigned int op;
+	u64 now;
+
+	if (!stats)
+		return;
+
+	now = ktime_get_ns();
+	op = blk_example_stat_op(rq);
+
+	st = get_cpu_ptr(bq->stats);
+	st->ios[op]++;
+	st->bytes[op] += blk_rq_bytes(rq);
+	if (cmd->nt)
+		st->nt_bytes += blk_rq_bytes(rq);
+	st->q2c[op][blk_example_hist_bucket(cmd->complete_ns - cmd->queue_ns)]++;
+	st->c2e[op][blk_example_hist_bucket(now - cmd->complete_ns)]++;
+	put_cpu_ptr(bq->stats);
+}
+
+static void blk_example_stats_sum(blk_example_queue *bq, blk_example_stats *sum)
+{
+	unsigned int op, b;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		blk_example_stats *st = per_cpu_ptr(bq->stats, cpu);
+
+		sum->nt_bytes += st->nt_bytes;
+		for (op = 0; op < BLK_EX_NR_STAT_OPS; op++) {
+			sum->ios[op] += st->ios[op];
+			sum->bytes[op] += st->bytes[op];
+			for (b = 0; b < BLK_EX_HIST_BUCKETS; b++) {
+				sum->q2c[op][b] += st->q2c[op][b];
+				sum->c2e[op][b] += st->c2e[op][b];
+			}
+		}
+	}
+}
+
+/*
+ * Clearing races with increments on other CPUs so a few I/Os around the reset
+ * may be lost, which is fine for what these are used for.
+ */
+static void blk_example_stats_reset(blk_example_queue *bq)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(bq->stats, cpu), 0, sizeof(blk_example_stats));
+	bq->stats_reset_ns = ktime_get_ns();
+}
+
+/* Upper bound in ns of the bucket holding the given fraction of samples */
+static u64 blk_example_hist_pct(const u64 *hist, u64 total, u32 pct)
+{
+	u64 target, seen = 0;
+	unsigned int b;
+
+	if (!total)
+		return 0;
+
+	target = div_u64(total * pct + BLK_EX_PCT_MAX - 1, BLK_EX_PCT_MAX);
+	for (b = 0; b < BLK_EX_HIST_BUCKETS; b++) {
+		seen += hist[b];
+		if (seen >= target)
+			break;
+	}
+
+	return 1ULL << (min_t(unsigned int, b, BLK_EX_HIST_BUCKETS - 1) +
+		BLK_EX_HIST_SHIFT);
+}
+
+static void blk_example_show_hist(struct seq_file *m, const char *name,
+	const u64 *hist, u64 total)
+{
+	unsigned int b;
+
+	seq_printf(m, "  %s p50<%llu p99<%llu p99.9<%llu ns\n", name,
+		blk_example_hist_pct(hist, total, 50000),
+		blk_example_hist_pct(hist, total, 99000),
+		blk_example_hist_pct(hist, total, 99900));
+	seq_printf(m, "  %s buckets", name);
+	for (b = 0; b < BLK_EX_HIST_BUCKETS; b++)
+		seq_printf(m, " %llu", hist[b]);
+	seq_puts(m, "\n");
+}
+
+static void blk_example_show_stats(struct seq_file *m, blk_example_stats *st,
+	u64 since_ns)
+{
+	u64 elapsed = ktime_get_ns() - since_ns;
+	unsigned int op;
+
+	seq_printf(m, "elapsed_ns %llu\n", elapsed);
+	seq_printf(m, "bucket_ns <%u then x2 per bucket\n",
+		1U << BLK_EX_HIST_SHIFT);
+	for (op = 0; op < BLK_EX_NR_STAT_OPS; op++) {
+		seq_printf(m, "%s ios %llu bytes %llu iops %llu\n",
+			blk_example_stat_names[op],
+			st->ios[op], st->bytes[op],
+			elapsed ? div64_u64(st->ios[op] * NSEC_PER_SEC, elapsed) : 0);
+		if (!st->ios[op])
+			continue;
+		blk_example_show_hist(m, "q2c", st->q2c[op], st->ios[op]);
+		blk_example_show_hist(m, "c2e", st->c2e[op], st->ios[op]);
+	}
+	seq_printf(m, "nt_write_bytes %llu\n", st->nt_bytes);
+}
+
+/* Per hardware queue stats, write anything to reset */
+static int blk_example_hctx_stats_show(struct seq_file *m, void *unused)
+{
+	blk_example_queue *bq = m->private;
+	blk_example_stats *sum;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	blk_example_stats_sum(bq, sum);
+	blk_example_show_stats(m, sum, bq->stats_reset_ns);
+	kfree(sum);
+
+	return 0;
+}
+
+static int blk_example_hctx_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, blk_example_hctx_stats_show, inode->i_private);
+}
+
+static ssize_t blk_example_hctx_stats_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+
+	blk_example_stats_reset(m->private);
+	return count;
+}
+
+static const struct file_operations blk_example_hctx_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= blk_example_hctx_stats_open,
+	.read		= seq_read,
+	.write		= blk_example_hctx_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* Stats summed over every hardware queue, write anything to reset them all */
+static int blk_example_all_stats_show(struct seq_file *m, void *unused)
+{
+	blk_example *ex = m->private;
+	struct blk_mq_hw_ctx *hctx;
+	blk_example_stats *sum;
+	unsigned long i;
+
+	sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+	if (!sum)
+		return -ENOMEM;
+
+	queue_for_each_hw_ctx(ex->rq_queue, hctx, i)
+		blk_example_stats_sum(hctx->driver_data, sum);
+	blk_example_show_stats(m, sum, ex->stats_reset_ns);
+	kfree(sum);
+
+	return 0;
+}
+
+static int blk_example_all_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, blk_example_all_stats_show, inode->i_private);
+}
+
+static ssize_t blk_example_all_stats_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	blk_example *ex = m->private;
+	struct blk_mq_hw_ctx *hctx;
+	unsigned long i;
+
+	queue_for_each_hw_ctx(ex->rq_queue, hctx, i)
+		blk_example_stats_reset(hctx->driver_data);
+	ex->stats_reset_ns = ktime_get_ns();
+
+	return count;
+}
+
+static const struct file_operations blk_example_all_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= blk_example_all_stats_open,
+	.read		= seq_read,
+	.write		= blk_example_all_stats_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void blk_example_stats_debugfs(blk_example *ex)
+{
+	struct blk_mq_hw_ctx *hctx;
+	unsigned long i;
+	char name[16];
+
+	if (!stats)
+		return;
+
+	ex->stats_reset_ns = ktime_get_ns();
+	debugfs_create_file("stats", 0644, ex->debugfs_dir, ex,
+		&blk_example_all_stats_fops);
+
+	queue_for_each_hw_ctx(ex->rq_queue, hctx, i) {
+		blk_example_queue *bq = hctx->driver_data;
+
+		snprintf(name, sizeof(name), "hctx%lu", i);
+		bq->debugfs_dir = debugfs_create_dir(name, ex->debugfs_dir);
+		debugfs_create_file("stats", 0644, bq->debugfs_dir, bq,
+			&blk_example_hctx_stats_fops);
+	}
+}
+
+/*
+ * Work queue callback to perform the deferred processing of requests when
+ * io_mode=0.  queue_rq() only adds requests to a per-CPU list; this runs once
+ * the first of them is added and processes everything on the list by then in
+ * one go.
+ */
+static void blk_example_complete(struct work_struct *work)
+{
+	blk_example_deferred *d =
+		container_of(work, blk_example_deferred, work);
+	struct llist_node *list;
+	blk_example_cmd *cmd, *next;
+
+	list = llist_reverse_order(llist_del_all(&d->list));
+	llist_for_each_entry_safe(cmd, next, list, lnode) {
+		cmd->status = blk_example_transfer(cmd->req, true);
+		blk_example_mark_complete(cmd);
+
+		/* Tell the block layer we're doing with the i/o */
+		blk_mq_complete_request(cmd->req);
+	}
+}
+
+/* Callback for when the block layer completes a request */
+static void blk_example_complete_rq(struct request *rq)
+{
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	blk_example_account(rq);
+	cmd->req = NULL;
+	/* Tell block layer to complete this back to upper layers */
+	blk_mq_end_request(rq, blk_example_cmd_status(cmd));
+}
+
+/*
+ * Latency and bandwidth emulation for io_mode=2.  The copy still happens in
+ * queue_rq() but the request is then parked on its hardware queue's pending
+ * timerqueue, sorted by the time a real device would have finished it.  One
+ * hrtimer per hardware queue is armed for the earliest deadline and completes
+ * everything that's due when it fires, so there's no CPU spinning or sleeping
+ * per request.
+ */
+
+/*
+ * Parse a percentile table such as "50:80,99:400,99.9:2500" where each entry
+ * is percentile:latency_us.  Percentiles may have up to three decimals and
+ * must be increasing.
+ */
+static int blk_example_parse_lat_table(const char *str, blk_example_emul *em)
+{
+	char *buf, *cur, *entry, *pct, *frac;
+	unsigned int whole, lat_us, len, i = 0;
+	u32 prev = 0;
+	int rc = -EINVAL;
+
+	buf = kstrdup(str, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	cur = buf;
+	while ((entry = strsep(&cur, ",")) != NULL) {
+		u32 p;
+
+		if (!*entry)
+			continue;
+		if (i == BLK_EX_LAT_TABLE_MAX)
+			goto out;
+
+		pct = strsep(&entry, ":");
+		if (!entry || kstrtouint(entry, 10, &lat_us))
+			goto out;
+
+		frac = pct;
+		pct = strsep(&frac, ".");
+		if (kstrtouint(pct, 10, &whole) || whole > 100)
+			goto out;
+		p = whole * 1000;
+
+		if (frac) {
+			unsigned int f, scale = 100;
+
+			len = strlen(frac);
+			if (!len || len > 3 || kstrtouint(frac, 10, &f))
+				goto out;
+			while (--len)
+				scale /= 10;
+			p += f * scale;
+		}
+
+		if (p > BLK_EX_PCT_MAX || (i && p <= prev))
+			goto out;
+
+		em->table[i].pct = p;
+		em->table[i].lat_ns = (u64)lat_us * NSEC_PER_USEC;
+		prev = p;
+		i++;
+	}
+
+	em->table_len = i;
+	rc = 0;
+out:
+	kfree(buf);
+	return rc;
+}
+
+static int blk_example_init_emul(blk_example_emul *em, unsigned int lat_us,
+	unsigned int jitter_us, const char *table, unsigned int mbps,
+	unsigned int iops)
+{
+	em->lat_ns = (u64)lat_us * NSEC_PER_USEC;
+	em->jitter_ns = (u64)jitter_us * NSEC_PER_USEC;
+	em->mbps = mbps;
+	em->iops = iops;
+	em->table_len = 0;
+	atomic64_set(&em->busy_until, 0);
+
+	if (table && *table)
+		return blk_example_parse_lat_table(table, em);
+
+	return 0;
+}
+
+/*
+ * Pick a latency.  With a percentile table we draw a uniform percentile and
+ * interpolate linearly between the two table entries around it, starting from
+ * lat_ns at the 0th percentile.
+ */
+static u64 blk_example_sample_latency(blk_example_emul *em)
+{
+	u64 prev_lat = em->lat_ns;
+	u32 prev_pct = 0, r;
+	unsigned int i;
+
+	if (em->table_len) {
+		r = get_random_u32_below(BLK_EX_PCT_MAX);
+		for (i = 0; i < em->table_len; i++) {
+			blk_example_lat_point *pt = &em->table[i];
+
+			if (r < pt->pct) {
+				if (pt->lat_ns <= prev_lat)
+					return pt->lat_ns;
+				return prev_lat + div_u64((pt->lat_ns - prev_lat) *
+					(r - prev_pct), pt->pct - prev_pct);
+			}
+			prev_pct = pt->pct;
+			prev_lat = pt->lat_ns;
+		}
+		return prev_lat;
+	}
+
+	if (em->jitter_ns)
+		return em->lat_ns + get_random_u32_below(min_t(u64, em->jitter_ns,
+			U32_MAX));
+
+	return em->lat_ns;
+}
+
+/*
+ * Bandwidth and IOPS caps.  busy_until is a virtual clock of when the device
+ * is free again.  Each request takes the later of now and busy_until as its
+ * start and pushes busy_until on by however long it occupies the device.
+ * Returns when the request has finished transferring.
+ */
+static u64 blk_example_throttle(blk_example_emul *em, u64 now,
+	unsigned int bytes)
+{
+	u64 cost = 0;
+	s64 old, start;
+
+	/* MB/s is 10^6 bytes per second, i.e. 1000 / mbps ns per byte */
+	if (em->mbps)
+		cost = div_u64((u64)bytes * 1000, em->mbps);
+	if (em->iops)
+		cost = max_t(u64, cost, div_u64(NSEC_PER_SEC, em->iops));
+	if (!cost)
+		return now;
+
+	old = atomic64_read(&em->busy_until);
+	do {
+		start = max_t(s64, old, now);
+	} while (!atomic64_try_cmpxchg(&em->busy_until, &old, start + cost));
+
+	return start + cost;
+}
+
+static enum hrtimer_restart blk_example_timer_fn(struct hrtimer *timer)
+{
+	blk_example_queue *bq = container_of(timer, blk_example_queue, timer);
+	struct timerqueue_node *node;
+	blk_example_cmd *cmd;
+	unsigned long flags;
+	LIST_HEAD(done);
+	ktime_t now = ktime_get();
+
+	spin_lock_irqsave(&bq->timer_lock, flags);
+	while ((node = timerqueue_getnext(&bq->pending)) != NULL) {
+		if (node->expires > now) {
+			/* Re-arm for the next one due */
+			hrtimer_start(&bq->timer, node->expires,
+				HRTIMER_MODE_ABS);
+			break;
+		}
+		timerqueue_del(&bq->pending, node);
+		cmd = container_of(node, blk_example_cmd, tnode);
+		if (stats)
+			cmd->complete_ns = ktime_to_ns(now);
+		list_add_tail(&cmd->list, &done);
+	}
+	spin_unlock_irqrestore(&bq->timer_lock, flags);
+
+	while (!list_empty(&done)) {
+		cmd = list_first_entry(&done, blk_example_cmd, list);
+		list_del_init(&cmd->list);
+		blk_mq_complete_request(cmd->req);
+	}
+
+	return HRTIMER_NORESTART;
+}
+
+/* Park a request on its queue's timerqueue until deadline (ktime in ns) */
+static void blk_example_complete_at(blk_example_queue *bq,
+	blk_example_cmd *cmd, u64 deadline)
+{
+	unsigned long flags;
+
+	timerqueue_init(&cmd->tnode);
+	cmd->tnode.expires = ns_to_ktime(deadline);
+
+	spin_lock_irqsave(&bq->timer_lock, flags);
+	if (timerqueue_add(&bq->pending, &cmd->tnode))
+		hrtimer_start(&bq->timer, cmd->tnode.expires, HRTIMER_MODE_ABS);
+	spin_unlock_irqrestore(&bq->timer_lock, flags);
+}
+
+/* Schedule completion of a request that's already been copied */
+static void blk_example_emul_queue(blk_example_queue *bq, struct request *rq)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	blk_example_emul *em = &ex->emul[op_is_write(req_op(rq))];
+	unsigned int bytes = 0;
+	u64 now = ktime_get_ns();
+	u64 deadline;
+
+	/* Discard, write zeroes and zone management only count against IOPS */
+	if (req_op(rq) == REQ_OP_READ || req_op(rq) == REQ_OP_WRITE ||
+	    req_op(rq) == REQ_OP_ZONE_APPEND)
+		bytes = blk_rq_bytes(rq);
+
+	deadline = blk_example_throttle(em, now, bytes) +
+		blk_example_sample_latency(em);
+	blk_example_complete_at(bq, cmd, deadline);
+}
+
+/* Hand a whole batch of successfully completed requests back at once */
+static void blk_example_complete_batch(struct io_comp_batch *iob)
+{
+	blk_mq_end_request_batch(iob);
+}
+
+/*
+ * Polled completion.  Requests on a HCTX_TYPE_POLL queue are copied in
+ * queue_rq() like inline mode but then parked on the queue's poll_list
+ * instead of being completed.  They're only completed when the submitter
+ * (e.g. io_uring with IORING_SETUP_IOPOLL) comes looking for them here.
+ */
+static int blk_example_poll(struct blk_mq_hw_ctx *hctx,
+	struct io_comp_batch *iob)
+{
+	blk_example_queue *bq = hctx->driver_data;
+	blk_example_cmd *cmd, *next;
+	blk_status_t status;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&bq->poll_lock);
+	list_splice_init(&bq->poll_list, &list);
+	spin_unlock(&bq->poll_lock);
+
+	list_for_each_entry_safe(cmd, next, &list, list) {
+		struct request *rq = cmd->req;
+
+		list_del_init(&cmd->list);
+		blk_example_account(rq);
+		cmd->req = NULL;
+		status = blk_example_cmd_status(cmd);
+		if (!blk_mq_add_to_batch(rq, iob, status != BLK_STS_OK,
+					 blk_example_complete_batch))
+			blk_mq_end_request(rq, status);
+		nr++;
+	}
+
+	return nr;
+}
+
+/*
+ * Fault injection and timeouts.  Every op class has a fault_attr for each
+ * kind of fault under debugfs faults/<op>/<kind>/, so e.g. 1% of writes can
+ * be failed while reads are delayed.  queue_rq() rolls the dice once the
+ * request is started:
+ *
+ *   fail  - complete right away with BLK_STS_IOERR, the store is untouched
+ *   drop  - never complete it, the block layer's timer goes off instead
+ *   delay - do the I/O and park it on the hardware queue's timerqueue, the
+ *           same one io_mode=2 uses, until delay_ms from now
+ *
+ * .timeout owns any request it can take off our lists (dropped, parked on
+ * the timerqueue or waiting to be polled) and requeues it up to retries
+ * times, BLK_EX_REQUEUE_DELAY_MS apart, before failing it with
+ * BLK_STS_TIMEOUT.  A request that's still being worked on, say loading from
+ * backing_file, gets its timer reset up to retries times.  After that it's
+ * marked timed out and whoever finishes it ends it with BLK_STS_TIMEOUT;
+ * .timeout can't complete it itself while it may still be on the deferred
+ * list or in the middle of a copy.
+ * Every injected fault and everything .timeout does goes in a small ring
+ * that debugfs faults/events shows.
+ */
+static void blk_example_fault_log(blk_example *ex, struct request *rq,
+	unsigned int event)
+{
+	blk_example_faults *f = ex->faults;
+	blk_example_fault_event *ev;
+	unsigned long flags;
+
+	spin_lock_irqsave(&f->log_lock, flags);
+	ev = &f->log[f->log_seq++ & (BLK_EX_FAULT_LOG - 1)];
+	ev->time_ns = ktime_get_ns();
+	ev->sector = blk_rq_pos(rq);
+	ev->bytes = blk_rq_bytes(rq);
+	ev->tag = rq->tag;
+	ev->op = blk_example_stat_op(rq);
+	ev->event = event;
+	f->count[ev->op][event]++;
+	spin_unlock_irqrestore(&f->log_lock, flags);
+}
+
+#ifdef CONFIG_FAULT_INJECTION
+static DECLARE_FAULT_ATTR(blk_example_fault_def);
+
+/* Which fault to inject into rq, BLK_EX_NR_FAULTS for none */
+static unsigned int blk_example_fault(blk_example *ex, struct request *rq)
+{
+	struct fault_attr *attr = ex->faults->attr[blk_example_stat_op(rq)];
+	unsigned int kind;
+
+	for (kind = 0; kind < BLK_EX_NR_FAULTS; kind++) {
+		if (should_fail(&attr[kind], blk_rq_bytes(rq)))
+			return kind;
+	}
+
+	return BLK_EX_NR_FAULTS;
+}
+
+/* Whether any fault can fire, so .queue_rqs knows to go through queue_rq() */
+static bool blk_example_faults_armed(blk_example *ex)
+{
+	unsigned int op, kind;
+
+	for (op = 0; op < BLK_EX_NR_STAT_OPS; op++) {
+		for (kind = 0; kind < BLK_EX_NR_FAULTS; kind++) {
+			if (READ_ONCE(ex->faults->attr[op][kind].probability))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+static void blk_example_faults_init_attrs(blk_example_faults *f)
+{
+	unsigned int op, kind;
+
+	/*
+	 * probability alone turns a fault on, without a limit on how many
+	 * times it fires.  Every event is in our own log so there's no need
+	 * to dump a stack for each.
+	 */
+	for (op = 0; op < BLK_EX_NR_STAT_OPS; op++) {
+		for (kind = 0; kind < BLK_EX_NR_FAULTS; kind++) {
+			f->attr[op][kind] = blk_example_fault_def;
+			atomic_set(&f->attr[op][kind].times, -1);
+			f->attr[op][kind].verbose = 0;
+		}
+	}
+}
+
+static void blk_example_faults_debugfs_attrs(blk_example *ex,
+	struct dentry *dir)
+{
+	static const char * const kinds[BLK_EX_NR_FAULTS] = {
+		"fail", "drop", "delay",
+	};
+	struct dentry *op_dir;
+	unsigned int op, kind;
+
+	for (op = 0; op < BLK_EX_NR_STAT_OPS; op++) {
+		op_dir = debugfs_create_dir(blk_example_stat_names[op], dir);
+		for (kind = 0; kind < BLK_EX_NR_FAULTS; kind++)
+			fault_create_debugfs_attr(kinds[kind], op_dir,
+				&ex->faults->attr[op][kind]);
+	}
+}
+#else
+static inline unsigned int blk_example_fault(blk_example *ex,
+	struct request *rq)
+{
+	return BLK_EX_NR_FAULTS;
+}
+
+static inline bool blk_example_faults_armed(blk_example *ex)
+{
+	return false;
+}
+
+static inline void blk_example_faults_init_attrs(blk_example_faults *f)
+{
+}
+
+static inline void blk_example_faults_debugfs_attrs(blk_example *ex,
+	struct dentry *dir)
+{
+}
+#endif
+
+/* Carry out the fault blk_example_fault() picked for a started request */
+static blk_status_t blk_example_inject(blk_example_queue *bq,
+	struct request *rq, unsigned int kind)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	/* Log it while rq is still ours to look at */
+	switch (kind) {
+	case BLK_EX_FAULT_FAIL:
+		blk_example_fault_log(ex, rq, kind);
+		cmd->status = BLK_STS_IOERR;
+		blk_example_mark_complete(cmd);
+		blk_example_complete_rq(rq);
+		break;
+	case BLK_EX_FAULT_DROP:
+		blk_example_fault_log(ex, rq, kind);
+		cmd->dropped = true;
+		break;
+	case BLK_EX_FAULT_DELAY:
+		cmd->status = blk_example_transfer(rq, ex->blocking);
+		if (cmd->status == BLK_STS_RESOURCE)
+			return BLK_STS_RESOURCE;
+		blk_example_fault_log(ex, rq, kind);
+		blk_example_complete_at(bq, cmd, ktime_get_ns() +
+			(u64)READ_ONCE(ex->faults->delay_ms) * NSEC_PER_MSEC);
+		break;
+	}
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Take cmd off whichever of our lists it's waiting on.  True if it was on
+ * one, the caller then owns it.
+ */
+static bool blk_example_reclaim(blk_example_queue *bq, blk_example_cmd *cmd)
+{
+	blk_example_cmd *pos;
+	unsigned long flags;
+	bool found = false;
+
+	spin_lock_irqsave(&bq->timer_lock, flags);
+	if (!RB_EMPTY_NODE(&cmd->tnode.node)) {
+		timerqueue_del(&bq->pending, &cmd->tnode);
+		found = true;
+	}
+	spin_unlock_irqrestore(&bq->timer_lock, flags);
+	if (found)
+		return true;
+
+	spin_lock(&bq->poll_lock);
+	list_for_each_entry(pos, &bq->poll_list, list) {
+		if (pos == cmd) {
+			list_del_init(&cmd->list);
+			found = true;
+			break;
+		}
+	}
+	spin_unlock(&bq->poll_lock);
+
+	return found;
+}
+
+static enum blk_eh_timer_return blk_example_timeout(struct request *rq)
+{
+	blk_example *ex = rq->q->queuedata;
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	blk_example_queue *bq = rq->mq_hctx->driver_data;
+
+	if (!cmd->dropped && !blk_example_reclaim(bq, cmd)) {
+		if (cmd->resets < READ_ONCE(ex->faults->retries)) {
+			cmd->resets++;
+			blk_example_fault_log(ex, rq, BLK_EX_EV_WAIT);
+			pr_warn_ratelimited("%s: tag %d sector %llu timed out while in progress\n",
+				ex->name, rq->tag, (u64)blk_rq_pos(rq));
+			return BLK_EH_RESET_TIMER;
+		}
+
+		blk_example_fault_log(ex, rq, BLK_EX_EV_ABORT);
+		pr_warn("%s: tag %d sector %llu still in progress after %u timeouts, failing it\n",
+			ex->name, rq->tag, (u64)blk_rq_pos(rq), cmd->resets + 1);
+		WRITE_ONCE(cmd->timed_out, true);
+		return BLK_EH_DONE;
+	}
+
+	cmd->dropped = false;
+	if (cmd->retries < READ_ONCE(ex->faults->retries)) {
+		cmd->retries++;
+		blk_example_fault_log(ex, rq, BLK_EX_EV_REQUEUE);
+		blk_mq_requeue_request(rq, false);
+		blk_mq_delay_kick_requeue_list(rq->q, BLK_EX_REQUEUE_DELAY_MS);
+		return BLK_EH_DONE;
+	}
+
+	blk_example_fault_log(ex, rq, BLK_EX_EV_ABORT);
+	cmd->status = BLK_STS_TIMEOUT;
+	blk_example_mark_complete(cmd);
+	blk_mq_complete_request(rq);
+	return BLK_EH_DONE;
+}
+
+/* Counts of every event by op, then the log oldest first */
+static int blk_example_fault_events_show(struct seq_file *m, void *unused)
+{
+	static const char * const events[BLK_EX_NR_EVENTS] = {
+		"fail", "drop", "delay", "requeue", "abort", "wait",
+	};
+	blk_example *ex = m->private;
+	blk_example_faults *f = ex->faults, *snap;
+	unsigned int op, ev;
+	u64 i, first;
+
+	snap = kmalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
+
+	spin_lock_irq(&f->log_lock);
+	memcpy(snap->count, f->count, sizeof(f->count));
+	memcpy(snap->log, f->log, sizeof(f->log));
+	snap->log_seq = f->log_seq;
+	spin_unlock_irq(&f->log_lock);
+
+	seq_puts(m, "op");
+	for (ev = 0; ev < BLK_EX_NR_EVENTS; ev++)
+		seq_printf(m, " %s", events[ev]);
+	seq_puts(m, "\n");
+	for (op = 0; op < BLK_EX_NR_STAT_OPS; op++) {
+		seq_puts(m, blk_example_stat_names[op]);
+		for (ev = 0; ev < BLK_EX_NR_EVENTS; ev++)
+			seq_printf(m, " %llu", snap->count[op][ev]);
+		seq_puts(m, "\n");
+	}
+
+	seq_puts(m, "time_ns op event tag sector bytes\n");
+	first = snap->log_seq > BLK_EX_FAULT_LOG ?
+		snap->log_seq - BLK_EX_FAULT_LOG : 0;
+	for (i = first; i < snap->log_seq; i++) {
+		blk_example_fault_event *e = &snap->log[i & (BLK_EX_FAULT_LOG - 1)];
+
+		seq_printf(m, "%llu %s %s %d %llu %u\n", e->time_ns,
+			blk_example_stat_names[e->op], events[e->event], e->tag,
+			(u64)e->sector, e->bytes);
+	}
+
+	kfree(snap);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(blk_example_fault_events);
+
+static int blk_example_faults_alloc(blk_example *ex)
+{
+	blk_example_faults *f;
+
+	f = kzalloc(sizeof(*f), GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+
+	blk_example_faults_init_attrs(f);
+	f->delay_ms = BLK_EX_FAULT_DELAY_MS;
+	f->retries = BLK_EX_FAULT_RETRIES;
+	spin_lock_init(&f->log_lock);
+	ex->faults = f;
+
+	return 0;
+}
+
+static void blk_example_faults_debugfs(blk_example *ex)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir("faults", ex->debugfs_dir);
+	blk_example_faults_debugfs_attrs(ex, dir);
+	debugfs_create_u32("delay_ms", 0644, dir, &ex->faults->delay_ms);
+	debugfs_create_u32("retries", 0644, dir, &ex->faults->retries);
+	debugfs_create_file("events", 0444, dir, ex,
+		&blk_example_fault_events_fops);
+}
+
+/* Callback block layer uses to queue a request to our driver */
+static blk_status_t blk_example_queue_rq(struct blk_mq_hw_ctx *hctx,
+	const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	blk_example_queue *bq = hctx->driver_data;
+	blk_example *ex = hctx->queue->queuedata;
+	blk_example_deferred *d;
+	blk_status_t status;
+	unsigned int fault;
+	int cpu;
+
+	/* Tell the block layer we've started processing this request */
+	blk_mq_start_request(rq);
+
+	/* A request .timeout requeued still has its back pointer set */
+	if (!cmd->req)
+		cmd->retries = 0;
+	cmd->resets = 0;
+	cmd->timed_out = false;
+	cmd->dropped = false;
+	cmd->nt = false;
+
+	/* Save the requst back pointer */
+	cmd->req = rq;
+	blk_example_mark_queued(cmd);
+
+	/*
+	 * A zone reset zeroes or frees a whole zone of store, which needs to
+	 * be able to sleep.  Unless queue_rq() itself can, hand it to the work
+	 * item on its own whatever the io_mode.  That happens before a fault
+	 * is rolled, so zone resets are never fault injected.
+	 */
+	if ((req_op(rq) == REQ_OP_ZONE_RESET ||
+	     req_op(rq) == REQ_OP_ZONE_RESET_ALL) && !ex->blocking)
+		goto defer;
+
+	fault = blk_example_fault(ex, rq);
+	if (unlikely(fault != BLK_EX_NR_FAULTS)) {
+		return blk_example_inject(bq, rq, fault);
+
+	/*
+	 * A flush has no data and unless there's a backing file there's
+	 * nothing for us to write back, so complete it right away without
+	 * going near the store or a work item.
+	 */
+	if (req_op(rq) == REQ_OP_FLUSH && !ex->file) {
+		cmd->status = BLK_STS_OK;
+		blk_example_mark_complete(cmd);
+		blk_example_complete_rq(rq);
+		return BLK_STS_OK;
+	}
+
+	if (hctx->type == HCTX_TYPE_POLL) {
+		cmd->status = blk_example_transfer(rq, ex->blocking);
+		if (cmd->status == BLK_STS_RESOURCE)
+			return BLK_STS_RESOURCE;
+		blk_example_mark_complete(cmd);
+
+		spin_lock(&bq->poll_lock);
+		list_add_tail(&cmd->list, &bq->poll_list);
+		spin_unlock(&bq->poll_lock);
+		return BLK_STS_OK;
+	}
+
+	if (ex->io_mode == BLK_EX_IO_TIMED) {
+		cmd->status = blk_example_transfer(rq, ex->blocking);
+		if (cmd->status == BLK_STS_RESOURCE)
+			return BLK_STS_RESOURCE;
+
+		blk_example_emul_queue(bq, rq);
+		return BLK_STS_OK;
+	}
+
+	if (ex->io_mode == BLK_EX_IO_INLINE) {
+		/*
+		 * Do the copy right here and complete on the CPU that
+		 * submitted the request.  We're running on a per-CPU hardware
+		 * queue so there's no need to bounce through
+		 * blk_mq_complete_request().
+		 */
+		cmd->status = blk_example_transfer(rq, ex->blocking);
+
+		/*
+		 * Couldn't get a sparse store page without sleeping.  Nothing
+		 * has been copied yet so let the block layer retry us.
+		 */
+		if (cmd->status == BLK_STS_RESOURCE)
+			return BLK_STS_RESOURCE;
+
+		blk_example_mark_complete(cmd);
+		blk_example_complete_rq(rq);
+		return BLK_STS_OK;
+	}
+
+	/*
+	 * Queue the actual copy and completion to a work queue.  The request
+	 * that finds this CPU's list empty queues the work, so a burst of
+	 * requests on one CPU still costs a single work item.  Waiting for
+	 * bd->last instead could strand requests: queue_rqs() and blocking
+	 * dispatch can move to another CPU part way through, leaving earlier
+	 * requests on a list nobody kicks.
+	 */
+defer:
+	cpu = get_cpu();
+	d = per_cpu_ptr(ex->deferred, cpu);
+	if (llist_add(&cmd->lnode, &d->list))
+		queue_work_on(cpu, system_wq, &d->work);
+	put_cpu();
+
+	return BLK_STS_OK;
+}
+
+/*
+ * Two requests can be handled as one run if they're the same kind of I/O on
+ * the same disk and the second starts right where the first ends.
+ */
+static bool blk_example_rq_contiguous(struct request *prev,
+	struct request *next)
+{
+	if (!next || next->q != prev->q || req_op(next) != req_op(prev) ||
+	    next->mq_hctx->type == HCTX_TYPE_POLL)
+		return false;
+
+	return blk_rq_pos(next) == blk_rq_pos(prev) + blk_rq_sectors(prev);
+}
+
+/*
+ * Inline mode batch.  run[] holds contiguous reads or writes so the stripe
+ * locks for the whole run are taken once and each request is copied back to
+ * back.  Completions go into iob so they're all ended with one
+ * blk_mq_end_request_batch().  Anything we couldn't get store pages for goes
+ * on requeue without being started.
+ */
+static void blk_example_queue_run(struct request **run, unsigned int nr,
+	struct io_comp_batch *iob, struct rq_list *requeue)
+{
+	blk_example *ex = run[0]->q->queuedata;
+	bool write = op_is_write(req_op(run[0]));
+	u64 start = (u64)blk_rq_pos(run[0]) << SECTOR_SHIFT;
+	u64 len = 0;
+	unsigned int i, ready;
+
+	for (ready = 0; ready < nr; ready++) {
+		if (blk_example_rw_prepare(run[ready], ex->blocking))
+			break;
+		len += blk_rq_bytes(run[ready]);
+	}
+
+	for (i = ready; i < nr; i++)
+		rq_list_add_tail(requeue, run[i]);
+
+	if (!ready)
+		return;
+
+	for (i = 0; i < ready; i++) {
+		blk_example_cmd *cmd = blk_mq_rq_to_pdu(run[i]);
+
+		blk_mq_start_request(run[i]);
+		cmd->retries = 0;
+		cmd->resets = 0;
+		cmd->timed_out = false;
+		cmd->dropped = false;
+		cmd->nt = false;
+		cmd->req = run[i];
+		blk_example_mark_queued(cmd);
+	}
+
+	if (len)
+		blk_example_lock_range(ex, start, len, write);
+	for (i = 0; i < ready; i++) {
+		blk_example_cmd *cmd = blk_mq_rq_to_pdu(run[i]);
+
+		cmd->status = blk_example_rw_copy(run[i]);
+		blk_example_mark_complete(cmd);
+	}
+	if (len)
+		blk_example_unlock_range(ex, start, len, write);
+
+	for (i = 0; i < ready; i++) {
+		blk_example_cmd *cmd = blk_mq_rq_to_pdu(run[i]);
+		blk_status_t status = blk_example_cmd_status(cmd);
+
+		blk_example_account(run[i]);
+		cmd->req = NULL;
+		if (!blk_mq_add_to_batch(run[i], iob, status != BLK_STS_OK,
+					 blk_example_complete_batch))
+			blk_mq_end_request(run[i], status);
+	}
+}
+
+/*
+ * Callback block layer uses to hand us a whole plug list at once.  In inline
+ * mode reads and writes are processed here in runs of contiguous requests
+ * with batched completion.  Everything else goes through the normal
+ * queue_rq() path, with the final request marked last.  So does the
+ * compressed store, which can run out of memory part way through the copy
+ * and needs queue_rq() to hand BLK_STS_RESOURCE back for a retry.
+ *
+ * Whatever is left in rqlist is reissued through queue_rq(), which starts it
+ * again, so only requests that were never started may go back on it.
+ * queue_rq() starts the request before it can run out of store pages, so
+ * those are requeued instead, which resets them to idle first.
+ */
+static void blk_example_queue_rqs(struct rq_list *rqlist)
+{
+	struct rq_list requeue_list = { };
+	struct blk_mq_queue_data bd = { };
+	struct request *run[BLK_EX_MAX_RUN];
+	DEFINE_IO_COMP_BATCH(iob);
+	struct request *rq;
+	unsigned int nr;
+
+	while ((rq = rq_list_pop(rqlist)) != NULL) {
+		blk_example *ex = rq->q->queuedata;
+
+		if (!batch_dispatch || ex->io_mode != BLK_EX_IO_INLINE ||
+		    rq->mq_hctx->type == HCTX_TYPE_POLL ||
+		    ex->compressed || blk_example_faults_armed(ex) ||
+		    (req_op(rq) != REQ_OP_READ &&
+		     (req_op(rq) != REQ_OP_WRITE || ex->zoned))) {
+			bd.rq = rq;
+			bd.last = rq_list_empty(rqlist);
+			if (blk_example_queue_rq(rq->mq_hctx, &bd) != BLK_STS_OK)
+				blk_mq_requeue_request(rq, true);
+			continue;
+		}
+
+		run[0] = rq;
+		nr = 1;
+		while (nr < BLK_EX_MAX_RUN &&
+		       blk_example_rq_contiguous(run[nr - 1],
+						 rq_list_peek(rqlist)))
+			run[nr++] = rq_list_pop(rqlist);
+
+		blk_example_queue_run(run, nr, &iob, &requeue_list);
+	}
+
+	if (iob.complete)
+		iob.complete(&iob);
+
+	*rqlist = requeue_list;
+}
+
+/*
+ * Split the hardware queues between the default (interrupt style) map and the
+ * poll map.  We don't use a separate read map.
+ */
+static void blk_example_map_queues(struct blk_mq_tag_set *set)
+{
+	blk_example *ex = set->driver_data;
+	unsigned int qoff = 0;
+	int i;
+
+	/* The shared tag set has only default queues */
+	if (!ex) {
+		blk_mq_map_queues(&set->map[HCTX_TYPE_DEFAULT]);
+		return;
+	}
+
+	for (i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map *map = &set->map[i];
+
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues = ex->submit_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = ex->poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+
+		map->queue_offset = qoff;
+		qoff += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+}
+
+/* Per hardware queue state lives on the same node as the queue's CPUs */
+static int blk_example_init_hctx(struct blk_mq_hw_ctx *hctx,
+	void *driver_data, unsigned int hctx_idx)
+{
+	blk_example_queue *bq;
+
+	bq = kzalloc_node(sizeof(*bq), GFP_KERNEL, hctx->numa_node);
+	if (!bq)
+		return -ENOMEM;
+
+	if (stats) {
+		bq->stats = alloc_percpu(blk_example_stats);
+		if (!bq->stats) {
+			kfree(bq);
+			return -ENOMEM;
+		}
+		bq->stats_reset_ns = ktime_get_ns();
+	}
+
+	spin_lock_init(&bq->poll_lock);
+	INIT_LIST_HEAD(&bq->poll_list);
+	spin_lock_init(&bq->timer_lock);
+	timerqueue_init_head(&bq->pending);
+	hrtimer_setup(&bq->timer, blk_example_timer_fn, CLOCK_MONOTONIC,
+		HRTIMER_MODE_ABS);
+	hctx->driver_data = bq;
+
+	return 0;
+}
+
+/* .timeout looks at these before the request has ever been queued */
+static int blk_example_init_request(struct blk_mq_tag_set *set,
+	struct request *rq, unsigned int hctx_idx, unsigned int numa_node)
+{
+	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	INIT_LIST_HEAD(&cmd->list);
+	timerqueue_init(&cmd->tnode);
+	return 0;
+}
+
+static void blk_example_exit_hctx(struct blk_mq_hw_ctx *hctx,
+	unsigned int hctx_idx)
+{
+	blk_example_queue *bq = hctx->driver_data;
+
+	hrtimer_cancel(&bq->timer);
+	free_percpu(bq->stats);
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
+}
+
+static const struct blk_mq_ops blk_example_ops = {
+	.queue_rq = blk_example_queue_rq,
+	.queue_rqs = blk_example_queue_rqs,
+	.complete = blk_example_complete_rq,
+	.timeout = blk_example_timeout,
+	.init_request = blk_example_init_request,
+	.init_hctx = blk_example_init_hctx,
+	.exit_hctx = blk_example_exit_hctx,
+	.map_queues = blk_example_map_queues,
+	.poll = blk_example_poll,
+};
+
+static int blk_example_start(blk_example *ex, blk_example *origin);
+
+/*
+ * Give ex a store that is a snapshot of origin's.  origin's top layer is
+ * frozen and becomes the parent of a new empty top layer for each of them,
+ * so only a couple of pointers change whatever the size of the disk.  The
+ * queue is frozen so no request is looking at origin's store meanwhile.
+ */
+static int blk_example_snap_store(blk_example *ex, blk_example *origin)
+{
+	blk_example_layer *frozen = origin->top;
+	blk_example_layer *otop, *stop;
+	unsigned int memflags;
+
+	otop = blk_example_layer_alloc(frozen);
+	stop = blk_example_layer_alloc(frozen);
+	if (!otop || !stop) {
+		blk_example_layer_put(otop);
+		blk_example_layer_put(stop);
+		return -ENOMEM;
+	}
+
+	memflags = blk_mq_freeze_queue(origin->rq_queue);
+	frozen->nr_pages = atomic_long_read(&origin->nr_pages);
+	origin->top = otop;
+	origin->pages = &otop->pages;
+	atomic_long_set(&origin->nr_pages, 0);
+	atomic_long_set(&origin->nr_same, 0);
+	/* origin now holds frozen through otop */
+	refcount_dec(&frozen->ref);
+	blk_mq_unfreeze_queue(origin->rq_queue, memflags);
+
+	ex->capacity = origin->capacity;
+	ex->sparse = true;
+	ex->top = stop;
+	ex->pages = &stop->pages;
+	atomic_long_set(&ex->nr_pages, 0);
+	atomic_long_set(&ex->nr_same, 0);
+
+	return 0;
+}
+
+/*
+ * BLK_EX_IOC_SNAPSHOT: add a new disk sharing origin's current contents.  It
+ * gets origin's queue settings.
+ */
+static int blk_example_snapshot(blk_example *origin)
+{
+	blk_example *ex;
+	int rc;
+
+	if (!origin->sparse || origin->compressed || origin->file ||
+	    origin->zoned)
+		return -EOPNOTSUPP;
+
+	ex = kzalloc(sizeof(*ex), GFP_KERNEL);
+	if (!ex)
+		return -ENOMEM;
+
+	ex->io_mode = origin->io_mode;
+	ex->nr_submit = origin->nr_submit;
+	ex->hw_queue_depth = origin->hw_queue_depth;
+	ex->shared_tags = origin->shared_tags;
+	memcpy(ex->emul, origin->emul, sizeof(ex->emul));
+
+	mutex_lock(&blk_example_lock);
+	if (!origin->powered)
+		rc = -ENODEV;
+	else
+		rc = blk_example_start(ex, origin);
+	mutex_unlock(&blk_example_lock);
+
+	if (rc) {
+		kfree(ex);
+		return rc;
+	}
+
+	return ex->id;
+}
+
+/*
+ * Block file operation handlers
+ */
+
+static int blk_example_open(struct gendisk *bdev, blk_mode_t mode)
+{
+	return 0;
+}
+
+static void blk_example_release(struct gendisk *disk)
+{}
+
+static int blk_example_ioctl(struct block_device *bdev, blk_mode_t mode,
+	unsigned int cmd, unsigned long arg)
+{
+	blk_example *ex = bdev->bd_disk->private_data;
+
+	switch (cmd) {
+	case BLK_EX_IOC_SNAPSHOT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EACCES;
+		return blk_example_snapshot(ex);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct block_device_operations blk_ex_fops = {
+	.owner =	THIS_MODULE,
+	.open =		blk_example_open,
+	.release =	blk_example_release,
+	.ioctl =	blk_example_ioctl,
+	.compat_ioctl =	blkdev_compat_ptr_ioctl,
+	.report_zones =	blk_example_report_zones,
+};
+
+/* Queue limits for a disk, from the module parameters */
+static void blk_example_set_limits(blk_example *ex, struct queue_limits *lim)
+{
+	/* Set max sector using queue_limits structure */
+	if (nomerges) {
+		lim->max_hw_sectors = BLK_SAFE_MAX_SECTORS;
+	} else {
+		/*
+		 * We're copying from memory so there's no real limit on how
+		 * big a segment or how many of them we can handle.  Let the
+		 * block layer build large requests so a big sequential I/O
+		 * costs one tag and one pass over the store.
+		 */
+		lim->max_hw_sectors = max_sectors;
+		lim->max_segments = BLK_EX_MAX_SEGMENTS;
+		lim->max_segment_size = UINT_MAX;
+	}
+
+	/*
+	 * Discard and write zeroes free pages in the sparse store so only
+	 * bother with page sized granularity.
+	 */
+	lim->discard_granularity = PAGE_SIZE;
+	lim->max_hw_discard_sectors = BLK_EX_MAX_DISCARD_SECTORS;
+	lim->max_write_zeroes_sectors = BLK_EX_MAX_DISCARD_SECTORS;
+
+	/* With a backing file flushes have to reach us */
+	if (write_cache || ex->file)
+		lim->features |= BLK_FEAT_WRITE_CACHE;
+
+	/*
+	 * Zoned disks reset zones instead of discarding.  Zone append can be
+	 * as big as any other write.
+	 */
+	if (ex->zoned) {
+		lim->features |= BLK_FEAT_ZONED;
+		lim->chunk_sectors = 1U << ex->zone_shift;
+		lim->max_hw_zone_append_sectors = lim->max_hw_sectors;
+		lim->max_hw_discard_sectors = 0;
+		lim->max_write_zeroes_sectors = 0;
+		lim->discard_granularity = 0;
+	}
+
+	/*
+	 * The block layer generates PI for writes and checks it on reads, we
+	 * check it on writes and keep it.  Type 3 has no reference tag.
+	 */
+	if (ex->pi_type) {
+		struct blk_integrity *bi = &lim->integrity;
+
+		bi->flags = BLK_INTEGRITY_DEVICE_CAPABLE;
+		if (ex->pi_type != 3)
+			bi->flags |= BLK_INTEGRITY_REF_TAG;
+		bi->csum_type = ex->pi_csum;
+		bi->metadata_size = sizeof(struct t10_pi_tuple);
+		bi->pi_tuple_size = sizeof(struct t10_pi_tuple);
+		bi->tag_size = ex->pi_type == 3 ? sizeof(u16) + sizeof(u32) :
+			sizeof(u16);
+		bi->interval_exp = SECTOR_SHIFT;
+	}
+
+	if (ex->dax_size)
+		lim->features |= BLK_FEAT_DAX;
+
+	if (ex->poll_queues)
+		lim->features |= BLK_FEAT_POLL;
+}
+
+/* A tag set of the disk's own */
+static int blk_example_init_tagset(blk_example *ex)
+{
+	int rc;
+
+	memset(&ex->tagset, 0, sizeof(ex->tagset));
+
+	/* Set up tagset with basic definitions about our queue size and metadata */
+	ex->tagset.ops = &blk_example_ops;
+	ex->tagset.queue_depth = ex->hw_queue_depth;
+	if (ex->nr_submit) {
+		ex->submit_queues = ex->nr_submit;
+	} else if (ex->io_mode != BLK_EX_IO_DEFERRED) {
+		/* One hardware context per CPU */
+		ex->submit_queues = num_online_cpus();
+	} else {
+		ex->submit_queues = 1;
+	}
+
+	/* Poll queues come after the default ones */
+	ex->poll_queues = poll_queues;
+	ex->tagset.nr_hw_queues = ex->submit_queues + ex->poll_queues;
+	if (ex->poll_queues)
+		ex->tagset.nr_maps = HCTX_MAX_TYPES;
+
+	/*
+	 * Loading pages from a backing file sleeps so queue_rq() has to be
+	 * allowed to.
+	 */
+	if (ex->blocking)
+		ex->tagset.flags |= BLK_MQ_F_BLOCKING;
+
+	/*
+	 * With NUMA_NO_NODE blk-mq allocates the tags, requests and our pdu
+	 * for each hardware queue on the node of the CPUs mapped to it.
+	 */
+	ex->tagset.numa_node = NUMA_NO_NODE;
+	ex->tagset.cmd_size = sizeof(blk_example_cmd);
+	ex->tagset.timeout = BLK_EX_TMO;
+	ex->tagset.driver_data = ex;
+
+	rc = blk_mq_alloc_tag_set(&ex->tagset);
+	if (rc) {
+		pr_warn("%s(): Tag set allocation failed", __func__);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
 
 /*
- * Work queue callback to perform the deferred processing of a request. This
- * is where the real work of processing the bio_vec's in the request to copy
- * data to/from the backing memory store.
+ * The tag set shared by every shared_tags disk.  Its queue count and depth
+ * come from the module parameters and it has no poll queues.  Called with
+ * blk_example_lock held.
  */
-static void blk_example_complete(struct work_struct *work)
+static int blk_example_get_shared_set(void)
 {
-	struct req_iterator iter;
-	struct bio_vec bvec;
-	blk_example_cmd *cmd =
-		container_of(work, blk_example_cmd, work);
-	sector_t sector = blk_rq_pos(cmd->req);
-	void *store_addr, *page_addr;
+	struct blk_mq_tag_set *set = &blk_example_shared_set;
+	int rc;
+
+	if (blk_example_shared_users) {
+		blk_example_shared_users++;
+		return 0;
+	}
+
+	memset(set, 0, sizeof(*set));
+	set->ops = &blk_example_ops;
+	set->nr_hw_queues = submit_queues ? submit_queues : num_online_cpus();
+	set->queue_depth = hw_queue_depth;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(blk_example_cmd);
+	set->timeout = BLK_EX_TMO;
+
+	rc = blk_mq_alloc_tag_set(set);
+	if (rc) {
+		pr_warn("%s(): Tag set allocation failed", __func__);
+		return -ENOMEM;
+	}
+
+	blk_example_shared_users = 1;
+	return 0;
+}
+
+static void blk_example_free_tagset(blk_example *ex)
+{
+	if (ex->set != &blk_example_shared_set)
+		blk_mq_free_tag_set(&ex->tagset);
+	else if (!--blk_example_shared_users)
+		blk_mq_free_tag_set(&blk_example_shared_set);
+	ex->set = NULL;
+}
+
+/*
+ * Bring up one disk: its stripe locks, tag set, store and gendisk.  The main
+ * disk gets a new store from the module parameters, a snapshot shares
+ * origin's.
+ */
+static int blk_example_add_dev(blk_example *ex, blk_example *origin)
+{
+	struct queue_limits lim = { };
+	int retval;
+	int rc;
+	int cpu;
+
+	retval = blk_example_alloc_stripes(ex);
+	if (retval)
+		return retval;
+
+	ex->deferred = alloc_percpu(blk_example_deferred);
+	if (!ex->deferred) {
+		retval = -ENOMEM;
+		goto out_free_stripes;
+	}
+	for_each_possible_cpu(cpu) {
+		blk_example_deferred *d = per_cpu_ptr(ex->deferred, cpu);
+
+		init_llist_head(&d->list);
+		INIT_WORK(&d->work, blk_example_complete);
+	}
+
+	retval = blk_example_faults_alloc(ex);
+	if (retval)
+		goto out_free_deferred;
+
+	if (ex->shared_tags) {
+		/* Queue count and depth are the shared set's */
+		if (ex->blocking) {
+			pr_warn("%s(): shared_tags can't be used with backing_file\n",
+				__func__);
+			retval = -EINVAL;
+			goto out_free_deferred;
+		}
+		retval = blk_example_get_shared_set();
+		if (retval)
+			goto out_free_deferred;
+		ex->set = &blk_example_shared_set;
+		ex->submit_queues = ex->set->nr_hw_queues;
+		ex->poll_queues = 0;
+	} else {
+		retval = blk_example_init_tagset(ex);
+		if (retval)
+			goto out_free_deferred;
+		ex->set = &ex->tagset;
+	}
 
 	/*
-	 * Actual address into the store depends on which sector we're read/
-	 * writing to.
+	 * The store goes after the tag set so that with numa_mode=2 we know
+	 * which node each hardware queue lives on.
 	 */
-	store_addr = blk_ex.store + sector * 512;
+	if (origin)
+		retval = blk_example_snap_store(ex, origin);
+	else
+		retval = blk_example_alloc_store(ex);
+	if (retval)
+		goto out_free_queue;
 
-	mutex_lock(&blk_ex.store_mutex);
-	rq_for_each_segment(bvec, cmd->req, iter) {
-		/* Get memory of address to use in memcpy */
-		page_addr = kmap_atomic(bvec.bv_page);
-		if (page_addr == NULL) {
-			cmd->status = BLK_STS_IOERR;
-			mutex_unlock(&blk_ex.store_mutex);
-			goto out;
-		}
+	if (ex->zoned) {
+		retval = blk_example_init_zones(ex);
+		if (retval)
+			goto out_free_store;
+	}
 
-		/* Adjust page address based on offset in bio_vec */
-		page_addr = page_addr + bvec.bv_offset;
-		if (op_is_write(req_op(cmd->req))) {
-			memcpy(store_addr, page_addr, bvec.bv_len);
-		} else {
-			memcpy(page_addr, store_addr, bvec.bv_len);
+	retval = blk_example_pi_init(ex);
+	if (retval)
+		goto out_free_store;
+
+	/* Allocate gendisk and block layer request queue */
+	blk_example_set_limits(ex, &lim);
+	ex->disk = blk_mq_alloc_disk(ex->set, &lim, ex);
+	if (IS_ERR(ex->disk)) {
+		pr_warn("%s(): alloc_disk failed\n", __func__);
+		retval = PTR_ERR(ex->disk);
+		goto out_free_store;
+	}
+
+	/* Set request queue back pointer*/
+	ex->rq_queue = ex->disk->queue;
+
+	/* Set backpointer for reference if needed */
+	ex->rq_queue->queuedata = ex;
+
+	/* Set no merges so that each request is it's own page */
+	if (nomerges)
+		blk_queue_flag_set(QUEUE_FLAG_NOMERGES, ex->rq_queue);
+	
+	/* Setup gendisk object to call add_disk */
+	ex->disk->major = blk_example_major;
+	ex->disk->minors = 1;
+	ex->disk->first_minor = ex->id + 1;
+	ex->disk->fops = &blk_ex_fops;
+	ex->disk->private_data = ex;
+	ex->disk->queue = ex->rq_queue;
+	strscpy(ex->disk->disk_name, ex->name, DISK_NAME_LEN);
+
+	/* Set in number of 512 byte sectors */
+	set_capacity(ex->disk, ex->capacity >> SECTOR_SHIFT);
+
+	retval = blk_example_dax_register(ex);
+	if (retval) {
+		pr_warn("%s(): dax setup failed, rc=%d\n", __func__, retval);
+		goto out_put_disk;
+	}
+
+	if (ex->zoned) {
+		rc = blk_revalidate_disk_zones(ex->disk);
+		if (rc) {
+			pr_warn("%s(): zone revalidation failed, rc=%d\n",
+				__func__, rc);
+			retval = rc;
+			goto out_put_disk;
 		}
+	}
 
-		/* Update the address of the store based on the length */
-		store_addr = store_addr + bvec.bv_len;
-		kunmap_atomic(page_addr);
+	/* Announce to the world that I'm here */
+	rc = add_disk(ex->disk);
+	if (rc < 0) {
+		pr_warn("%s(): add_disk failed, rc=%d", __func__, rc);
+		retval = rc;
+		goto out_put_disk;
 	}
-	mutex_unlock(&blk_ex.store_mutex);
 
-	/* We're always sunshine and lollipops */
-	cmd->status = BLK_STS_OK;
+	ex->debugfs_dir = debugfs_create_dir(ex->disk->disk_name, NULL);
+	debugfs_create_file("stripes", 0444, ex->debugfs_dir, ex,
+		&blk_example_stripes_fops);
+	debugfs_create_file("store", 0444, ex->debugfs_dir, ex,
+		&blk_example_store_fops);
+	debugfs_create_file("numa", 0444, ex->debugfs_dir, ex,
+		&blk_example_numa_fops);
+	if (ex->pi)
+		debugfs_create_file("integrity", 0444, ex->debugfs_dir, ex,
+			&blk_example_integrity_fops);
+	blk_example_faults_debugfs(ex);
+	blk_example_stats_debugfs(ex);
 
-out:
-	/* Tell the block layer we're doing with the i/o */
-	blk_mq_complete_request(cmd->req);
+	return 0;
+
+out_put_disk:
+	blk_example_dax_unregister(ex);
+	put_disk(ex->disk);
+out_free_store:
+	blk_example_pi_exit(ex);
+	kvfree(ex->zones);
+	ex->zones = NULL;
+	blk_example_free_store(ex);
+out_free_queue:
+	blk_example_free_tagset(ex);
+out_free_deferred:
+	kfree(ex->faults);
+	free_percpu(ex->deferred);
+out_free_stripes:
+	blk_example_free_stripes(ex);
+
+	return retval;
 }
 
-/* Callback block layer uses to queue a request to our driver */
-static blk_status_t blk_example_queue_rq(struct blk_mq_hw_ctx *hctx,
-	const struct blk_mq_queue_data *bd)
+static void blk_example_del_dev(blk_example *ex)
 {
-	struct request *rq = bd->rq;
-	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	int cpu;
 
-	/* Tell the block layer we've started processing this request */
-	blk_mq_start_request(rq);
+	debugfs_remove_recursive(ex->debugfs_dir);
+	blk_example_dax_unregister(ex);
+	del_gendisk(ex->disk);
+	for_each_possible_cpu(cpu)
+		flush_work(&per_cpu_ptr(ex->deferred, cpu)->work);
+	put_disk(ex->disk);
+	blk_example_free_tagset(ex);
+	kfree(ex->faults);
+	free_percpu(ex->deferred);
+	kvfree(ex->zones);
+	ex->zones = NULL;
+	blk_example_pi_exit(ex);
+	/* Final writeback to backing_file still takes the stripe locks */
+	blk_example_free_store(ex);
+	blk_example_free_stripes(ex);
+}
 
-	/* Save the requst back pointer */
-	cmd->req = rq;
+/*
+ * Give ex a minor and a name and bring it up, as a snapshot of origin if
+ * that's set.  Called with blk_example_lock held.
+ */
+static int blk_example_start(blk_example *ex, blk_example *origin)
+{
+	int rc;
 
-	/* Queue the actual copy and completion to a work queue */
-	INIT_WORK(&cmd->work, blk_example_complete);
-	schedule_work(&cmd->work);
+	rc = ida_alloc_range(&blk_example_ida, 0, MINORMASK - 1, GFP_KERNEL);
+	if (rc < 0)
+		return rc;
+	ex->id = rc;
 
-	return BLK_STS_OK;
+	if (origin)
+		snprintf(ex->name, sizeof(ex->name), "blk_example_snap%d",
+			ex->id);
+	else if (!ex->name[0] && ex->id)
+		snprintf(ex->name, sizeof(ex->name), "blk_example%d", ex->id);
+	else if (!ex->name[0])
+		strscpy(ex->name, "blk_example", sizeof(ex->name));
+
+	rc = blk_example_add_dev(ex, origin);
+	if (rc) {
+		ida_free(&blk_example_ida, ex->id);
+		return rc;
+	}
+
+	list_add_tail(&ex->list, &blk_example_devs);
+	ex->powered = true;
+	return 0;
 }
 
-/* Callback for when the block layer completes a request */
-static void blk_example_complete_rq(struct request *rq)
+/* Take a disk down again, called with blk_example_lock held */
+static void blk_example_stop(blk_example *ex)
 {
-	blk_example_cmd *cmd = blk_mq_rq_to_pdu(rq);
-
-	cmd->req = NULL;
-	/* Tell block layer to complete this back to upper layers */
-	blk_mq_end_request(rq, cmd->status);
+	ex->powered = false;
+	list_del(&ex->list);
+	blk_example_del_dev(ex);
+	ida_free(&blk_example_ida, ex->id);
 }
 
-static const struct blk_mq_ops blk_example_ops = {
-	.queue_rq = blk_example_queue_rq,
-	.complete = blk_example_complete_rq
-};
+/* A new disk set up from the module parameters */
+static blk_example *blk_example_alloc_dev(void)
+{
+	blk_example *ex;
+
+	ex = kzalloc(sizeof(*ex), GFP_KERNEL);
+	if (!ex)
+		return NULL;
+
+	/* Only the first disk takes its size from backing_file */
+	ex->capacity = (u64)(num_sectors ? num_sectors : BLK_EX_SIZE) <<
+		SECTOR_SHIFT;
+	ex->sparse = sparse;
+	ex->numa_mode = numa_mode;
+	ex->huge = huge_store;
+	ex->pi_type = pi_type;
+	ex->pi_csum = blk_example_pi_csum_def;
+	ex->io_mode = io_mode;
+	ex->nr_submit = submit_queues;
+	ex->hw_queue_depth = hw_queue_depth;
+	ex->shared_tags = shared_tags;
+	memcpy(ex->emul, blk_example_emul_def, sizeof(ex->emul));
+
+	return ex;
+}
 
 /*
- * Block file operation handlers
+ * configfs.  mkdir /sys/kernel/config/blk_example/<name> describes a new disk
+ * with the module parameters as defaults.  Writing 1 to its power attribute
+ * creates /dev/<name> and writing 0 removes it.  Settings can only be
+ * changed while the disk is off.
  */
+static inline blk_example *to_blk_example(struct config_item *item)
+{
+	return container_of(item, blk_example, item);
+}
 
-static int blk_example_open(struct gendisk *bdev, blk_mode_t mode)
+#define BLK_EX_CFG_ATTR(_name, _field, _min, _max)			\
+static ssize_t blk_example_cfg_##_name##_show(struct config_item *item,	\
+	char *page)							\
+{									\
+	return sysfs_emit(page, "%u\n",					\
+		(unsigned int)to_blk_example(item)->_field);		\
+}									\
+									\
+static ssize_t blk_example_cfg_##_name##_store(struct config_item *item,	\
+	const char *page, size_t count)					\
+{									\
+	blk_example *ex = to_blk_example(item);				\
+	unsigned int val;						\
+	int rc;								\
+									\
+	rc = kstrtouint(page, 0, &val);					\
+	if (rc)								\
+		return rc;						\
+	if (val < (_min) || val > (_max))				\
+		return -EINVAL;						\
+									\
+	mutex_lock(&blk_example_lock);					\
+	if (ex->powered)						\
+		rc = -EBUSY;						\
+	else								\
+		ex->_field = val;					\
+	mutex_unlock(&blk_example_lock);				\
+									\
+	return rc ? rc : count;						\
+}									\
+CONFIGFS_ATTR(blk_example_cfg_, _name)
+
+BLK_EX_CFG_ATTR(submit_queues, nr_submit, 0, nr_cpu_ids);
+BLK_EX_CFG_ATTR(hw_queue_depth, hw_queue_depth, 1, BLK_MQ_MAX_DEPTH);
+BLK_EX_CFG_ATTR(io_mode, io_mode, BLK_EX_IO_DEFERRED, BLK_EX_IO_TIMED);
+BLK_EX_CFG_ATTR(shared_tags, shared_tags, 0, 1);
+BLK_EX_CFG_ATTR(sparse, sparse, 0, 1);
+BLK_EX_CFG_ATTR(numa_mode, numa_mode, BLK_EX_NUMA_NONE, BLK_EX_NUMA_HCTX);
+BLK_EX_CFG_ATTR(huge_store, huge, BLK_EX_HUGE_NONE, BLK_EX_HUGE_PAGES);
+BLK_EX_CFG_ATTR(pi_type, pi_type, 0, 3);
+
+static ssize_t blk_example_cfg_num_sectors_show(struct config_item *item,
+	char *page)
 {
-	return 0;
+	return sysfs_emit(page, "%llu\n",
+		to_blk_example(item)->capacity >> SECTOR_SHIFT);
 }
 
-static void blk_example_release(struct gendisk *disk)
-{}
+static ssize_t blk_example_cfg_num_sectors_store(struct config_item *item,
+	const char *page, size_t count)
+{
+	blk_example *ex = to_blk_example(item);
+	u64 val;
+	int rc;
 
-static int blk_example_ioctl(struct block_device *bdev, fmode_t mode,
-	unsigned int cmd, unsigned long arg)
+	rc = kstrtoull(page, 0, &val);
+	if (rc)
+		return rc;
+	if (!val || val > (U64_MAX >> SECTOR_SHIFT))
+		return -EINVAL;
+
+	mutex_lock(&blk_example_lock);
+	if (ex->powered)
+		rc = -EBUSY;
+	else
+		ex->capacity = val << SECTOR_SHIFT;
+	mutex_unlock(&blk_example_lock);
+
+	return rc ? rc : count;
+}
+CONFIGFS_ATTR(blk_example_cfg_, num_sectors);
+
+static ssize_t blk_example_cfg_power_show(struct config_item *item,
+	char *page)
 {
-	return 0;
+	return sysfs_emit(page, "%u\n", to_blk_example(item)->powered);
 }
 
-static const struct block_device_operations blk_ex_fops = {
-	.owner =	THIS_MODULE,
-	.open =		blk_example_open,
-	.release =	blk_example_release,
-	.ioctl =	blk_example_ioctl,
+static ssize_t blk_example_cfg_power_store(struct config_item *item,
+	const char *page, size_t count)
+{
+	blk_example *ex = to_blk_example(item);
+	bool on;
+	int rc;
+
+	rc = kstrtobool(page, &on);
+	if (rc)
+		return rc;
+
+	mutex_lock(&blk_example_lock);
+	if (on && !ex->powered) {
+		strscpy(ex->name, config_item_name(item), sizeof(ex->name));
+		rc = blk_example_start(ex, NULL);
+	} else if (!on && ex->powered) {
+		blk_example_stop(ex);
+	}
+	mutex_unlock(&blk_example_lock);
+
+	return rc ? rc : count;
+}
+CONFIGFS_ATTR(blk_example_cfg_, power);
+
+static struct configfs_attribute *blk_example_cfg_attrs[] = {
+	&blk_example_cfg_attr_num_sectors,
+	&blk_example_cfg_attr_submit_queues,
+	&blk_example_cfg_attr_hw_queue_depth,
+	&blk_example_cfg_attr_io_mode,
+	&blk_example_cfg_attr_shared_tags,
+	&blk_example_cfg_attr_sparse,
+	&blk_example_cfg_attr_numa_mode,
+	&blk_example_cfg_attr_huge_store,
+	&blk_example_cfg_attr_pi_type,
+	&blk_example_cfg_attr_power,
+	NULL,
 };
 
+static void blk_example_cfg_release(struct config_item *item)
+{
+	kfree(to_blk_example(item));
+}
+
+static struct configfs_item_operations blk_example_cfg_item_ops = {
+	.release = blk_example_cfg_release,
+};
+
+static const struct config_item_type blk_example_cfg_type = {
+	.ct_item_ops	= &blk_example_cfg_item_ops,
+	.ct_attrs	= blk_example_cfg_attrs,
+	.ct_owner	= THIS_MODULE,
+};
+
+static struct config_item *blk_example_cfg_make_item(
+	struct config_group *group, const char *name)
+{
+	blk_example *ex;
+
+	if (strlen(name) >= DISK_NAME_LEN)
+		return ERR_PTR(-ENAMETOOLONG);
+
+	ex = blk_example_alloc_dev();
+	if (!ex)
+		return ERR_PTR(-ENOMEM);
+
+	config_item_init_type_name(&ex->item, name, &blk_example_cfg_type);
+	return &ex->item;
+}
+
+static void blk_example_cfg_drop_item(struct config_group *group,
+	struct config_item *item)
+{
+	blk_example *ex = to_blk_example(item);
+
+	mutex_lock(&blk_example_lock);
+	if (ex->powered)
+		blk_example_stop(ex);
+	mutex_unlock(&blk_example_lock);
+
+	config_item_put(item);
+}
+
+static struct configfs_group_operations blk_example_cfg_group_ops = {
+	.make_item	= blk_example_cfg_make_item,
+	.drop_item	= blk_example_cfg_drop_item,
+};
+
+static const struct config_item_type blk_example_cfg_group_type = {
+	.ct_group_ops	= &blk_example_cfg_group_ops,
+	.ct_owner	= THIS_MODULE,
+};
+
+static struct configfs_subsystem blk_example_subsys = {
+	.su_group = {
+		.cg_item = {
+			.ci_namebuf = DRV_NAME,
+			.ci_type = &blk_example_cfg_group_type,
+		},
+	},
+};
+
+/* dax_mem is size@start with the usual K, M, G suffixes, both 2 MiB aligned */
+static int __init blk_example_parse_dax_mem(const char *str, u64 *size,
+	phys_addr_t *start)
+{
+	char *end;
+
+	*size = memparse(str, &end);
+	if (*end != '@')
+		return -EINVAL;
+	*start = memparse(end + 1, &end);
+	if (*end || !*size || !IS_ALIGNED(*size | *start, SZ_2M))
+		return -EINVAL;
+
+	return 0;
+}
+
 static int __init blk_example_init(void) {
+	blk_example *ex, *next;
+	phys_addr_t dax_phys = 0;
+	u64 dax_size = 0;
+	unsigned int i;
 	int rc;
 	int retval;
-	struct queue_limits lim = {
-		/* Set max sector using queue_limits structure */
-		.max_hw_sectors = BLK_SAFE_MAX_SECTORS,
-	};
 
-	if (num_sectors == 0)
+	if (dax_mem && *dax_mem) {
+		if (blk_example_parse_dax_mem(dax_mem, &dax_size, &dax_phys)) {
+			pr_warn("%s(): invalid dax_mem=%s\n", __func__, dax_mem);
+			return -EINVAL;
+		}
+		if (zoned || (compress && *compress) ||
+		    (backing_file && *backing_file)) {
+			pr_warn("%s(): dax_mem can't be used with zoned, compress or backing_file\n",
+				__func__);
+			return -EINVAL;
+		}
+	}
+
+	if (backing_file && *backing_file) {
+		if (zoned || (compress && *compress)) {
+			pr_warn("%s(): backing_file can't be used with zoned or compress\n",
+				__func__);
+			return -EINVAL;
+		}
+	} else if (num_sectors == 0) {
 		num_sectors = BLK_EX_SIZE;
+	}
 
-	blk_ex.store = vmalloc(num_sectors * 512);
-	if (!blk_ex.store) {
-		pr_info("%s(): store is NULL\n", __func__);
-		return -ENOMEM;
+	if (zoned) {
+		unsigned long zone_sectors = (unsigned long)zone_size <<
+			(20 - SECTOR_SHIFT);
+
+		if (!IS_ENABLED(CONFIG_BLK_DEV_ZONED)) {
+			pr_warn("%s(): zoned=1 needs CONFIG_BLK_DEV_ZONED\n",
+				__func__);
+			return -EOPNOTSUPP;
+		}
+
+		if (!is_power_of_2(zone_size)) {
+			pr_warn("%s(): zone_size=%u must be a power of 2\n",
+				__func__, zone_size);
+			return -EINVAL;
+		}
+
+		/* Only whole zones */
+		if (zone_nr)
+			num_sectors = zone_nr * zone_sectors;
+		num_sectors = round_down(num_sectors, zone_sectors);
+		if (!num_sectors || zone_nr_conv >= num_sectors / zone_sectors) {
+			pr_warn("%s(): need at least one sequential zone\n",
+				__func__);
+			return -EINVAL;
+		}
 	}
 
-	rc = register_blkdev(0, DRV_NAME);
-	if (rc < 0) {
-		pr_warn("%s(): register_blkdev() failed rc=%d\n", __func__, rc);
-		return rc;
+	if (io_mode > BLK_EX_IO_TIMED) {
+		pr_warn("%s(): invalid io_mode=%u\n", __func__, io_mode);
+		return -EINVAL;
 	}
 
-	blk_example_major = rc;
-	
-	/* Set up tagset with basic definitions about our queue size and metadata */
-	blk_ex.tagset.ops = &blk_example_ops;
-	blk_ex.tagset.nr_hw_queues = 1;
-	blk_ex.tagset.queue_depth = BLK_EX_Q_DEPTH;
-	blk_ex.tagset.numa_node = NUMA_NO_NODE;
-	blk_ex.tagset.cmd_size = sizeof(blk_example_cmd);
-	blk_ex.tagset.timeout = BLK_EX_TMO;
-	blk_ex.tagset.driver_data = &blk_ex;
-
-	rc = blk_mq_alloc_tag_set(&blk_ex.tagset);
-	if (rc) {
-		pr_warn("%s(): Tag set allocation failed", __func__);
-		retval = -ENOMEM;
-		goto out_unreg_blk;
+	if (blk_example_init_emul(&blk_example_emul_def[0], read_lat_us,
+			read_jitter_us, read_lat_table, read_mbps, read_iops) ||
+	    blk_example_init_emul(&blk_example_emul_def[1], write_lat_us,
+			write_jitter_us, write_lat_table, write_mbps, write_iops)) {
+		pr_warn("%s(): invalid latency table\n", __func__);
+		return -EINVAL;
 	}
 
-	/* Allocate gendisk and block layer request queue */
-	blk_ex.disk = blk_mq_alloc_disk(&blk_ex.tagset, &lim, &blk_ex);
-	if (!blk_ex.disk) {
-		pr_warn("%s(): alloc_disk failed\n", __func__);
-		goto out_free_queue;
+	if (hw_queue_depth == 0)
+		hw_queue_depth = BLK_EX_Q_DEPTH;
+
+	if (!nomerges && max_sectors < PAGE_SECTORS)
+		max_sectors = BLK_EX_MAX_SECTORS;
+
+	if (!is_power_of_2(stripe_size) || stripe_size < SECTOR_SIZE ||
+	    !is_power_of_2(nr_stripes)) {
+		pr_warn("%s(): stripe_size=%u and nr_stripes=%u must be powers of 2\n",
+			__func__, stripe_size, nr_stripes);
+		return -EINVAL;
 	}
 
-	/* Set request queue back pointer*/
-	blk_ex.rq_queue = blk_ex.disk->queue;
+	if (nr_stripes > BLK_EX_MAX_STRIPES) {
+		pr_warn("%s(): nr_stripes=%u is more than %u\n",
+			__func__, nr_stripes, BLK_EX_MAX_STRIPES);
+		return -EINVAL;
+	}
 
-	/* Set backpointer for reference if needed */
-	blk_ex.rq_queue->queuedata = &blk_ex;
+	if (numa_mode > BLK_EX_NUMA_HCTX) {
+		pr_warn("%s(): invalid numa_mode=%u\n", __func__, numa_mode);
+		return -EINVAL;
+	}
 
-	/* Set no merges so that each request is it's own page */
-	blk_queue_flag_set(QUEUE_FLAG_NOMERGES, blk_ex.rq_queue);
-	
-	/* Setup gendisk object to call add_disk */
-	blk_ex.disk->major = blk_example_major;
-	blk_ex.disk->minors = 1;
-	blk_ex.disk->first_minor = 1;
-	blk_ex.disk->fops = &blk_ex_fops;
-	blk_ex.disk->private_data = &blk_ex;
-	blk_ex.disk->queue = blk_ex.rq_queue;
-	sprintf(blk_ex.disk->disk_name, "blk_example");
+	if (huge_store > BLK_EX_HUGE_PAGES) {
+		pr_warn("%s(): invalid huge_store=%u\n", __func__, huge_store);
+		return -EINVAL;
+	}
+
+	if (pi_type > 3) {
+		pr_warn("%s(): invalid pi_type=%u\n", __func__, pi_type);
+		return -EINVAL;
+	}
 
-	/* Set in number of 1k byte sectors */
-	set_capacity(blk_ex.disk, num_sectors);
+	if (pi_guard && !strcmp(pi_guard, "ip")) {
+		blk_example_pi_csum_def = BLK_INTEGRITY_CSUM_IP;
+	} else if (pi_guard && *pi_guard && strcmp(pi_guard, "crc")) {
+		pr_warn("%s(): invalid pi_guard=%s\n", __func__, pi_guard);
+		return -EINVAL;
+	}
 
-	/* Announce to the world that I'm here */
-	rc = add_disk(blk_ex.disk);
+	rc = register_blkdev(0, DRV_NAME);
 	if (rc < 0) {
-		pr_warn("%s(): add_disk failed, rc=%d", __func__, rc);
-		goto out_free_queue;
+		pr_warn("%s(): register_blkdev() failed rc=%d\n", __func__, rc);
+		return rc;
+	}
+
+	blk_example_major = rc;
+
+	/* zoned, compress, backing_file and dax_mem only apply to the first disk */
+	mutex_lock(&blk_example_lock);
+	for (i = 0; i < nr_devices; i++) {
+		ex = blk_example_alloc_dev();
+		if (!ex) {
+			retval = -ENOMEM;
+			goto out_unlock;
+		}
+
+		if (i == 0) {
+			ex->capacity = (u64)num_sectors << SECTOR_SHIFT;
+			if (zoned) {
+				ex->zoned = true;
+				ex->zone_shift = ilog2((unsigned long)zone_size <<
+					(20 - SECTOR_SHIFT));
+			}
+			if (compress && *compress)
+				ex->compress = compress;
+			if (backing_file && *backing_file) {
+				ex->backing_path = backing_file;
+				ex->blocking = true;
+			}
+			if (dax_size) {
+				ex->dax_phys = dax_phys;
+				ex->dax_size = dax_size;
+				ex->capacity = dax_size;
+			}
+		}
+
+		retval = blk_example_start(ex, NULL);
+		if (retval) {
+			kfree(ex);
+			goto out_unlock;
+		}
+	}
+	mutex_unlock(&blk_example_lock);
+
+	config_group_init(&blk_example_subsys.su_group);
+	mutex_init(&blk_example_subsys.su_mutex);
+	retval = configfs_register_subsystem(&blk_example_subsys);
+	if (retval) {
+		pr_warn("%s(): configfs_register_subsystem() failed rc=%d\n",
+			__func__, retval);
+		mutex_lock(&blk_example_lock);
+		goto out_unlock;
 	}
-	mutex_init(&blk_ex.store_mutex);
 
 	return 0;
 
-out_free_queue:
-	blk_mq_free_tag_set(&blk_ex.tagset);
-out_unreg_blk:
+out_unlock:
+	list_for_each_entry_safe_reverse(ex, next, &blk_example_devs, list) {
+		blk_example_stop(ex);
+		kfree(ex);
+	}
+	mutex_unlock(&blk_example_lock);
 	unregister_blkdev(blk_example_major, DRV_NAME);
-
 	return retval;
 }
 
 static void __exit blk_example_exit(void) {
-	del_gendisk(blk_ex.disk);
-	blk_mq_free_tag_set(&blk_ex.tagset);
-	put_disk(blk_ex.disk);
+	blk_example *ex, *next;
+
+	/*
+	 * configfs disks hold a module reference so only the ones made at load
+	 * time and snapshots are left.  Newest first, snapshots may share store
+	 * pages with their origin.
+	 */
+	configfs_unregister_subsystem(&blk_example_subsys);
+
+	mutex_lock(&blk_example_lock);
+	list_for_each_entry_safe_reverse(ex, next, &blk_example_devs, list) {
+		blk_example_stop(ex);
+		kfree(ex);
+	}
+	mutex_unlock(&blk_example_lock);
+
 	unregister_blkdev(blk_example_major, DRV_NAME);
-	vfree(blk_ex.store);
 }
 
 module_init(blk_example_init);
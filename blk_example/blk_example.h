@@ -4,11 +4,30 @@
  * Copyright (C) 2019 Chad Dupuis
  */
 #include <linux/blk-mq.h>
-#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/cache.h>
+#include <linux/xarray.h>
 #include <linux/workqueue.h>
+#include <linux/llist.h>
+#include <linux/hrtimer.h>
+#include <linux/timerqueue.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/ioctl.h>
+#include <linux/configfs.h>
+#include <linux/t10-pi.h>
+#include <linux/fault-inject.h>
+#include <linux/memremap.h>
 
 #define DRV_NAME        "blk_example"
 
+/*
+ * ioctl on any sparse blk_example disk: create a copy-on-write snapshot of
+ * it, which appears as /dev/blk_example_snap<N>.  Returns N.
+ */
+#define BLK_EX_IOC_SNAPSHOT	_IO(0xBE, 0x01)
+
 #define BLK_EX_TMO		(5 * HZ)
 
 /* Number of 512 byte sectors */
@@ -16,16 +35,366 @@
 
 #define BLK_EX_Q_DEPTH      16
 
+/* Default largest request we accept in 512 byte sectors (1 MiB) */
+#define BLK_EX_MAX_SECTORS	2048
+
+/*
+ * Largest discard or write zeroes in 512 byte sectors (8 MiB).  In inline,
+ * poll and timed modes these run from queue_rq without a chance to resched,
+ * so the block layer has to split big ranges for us.
+ */
+#define BLK_EX_MAX_DISCARD_SECTORS	16384
+
+/* Scatter/gather limits when merging is enabled */
+#define BLK_EX_MAX_SEGMENTS	1024
+
+/* Default size in bytes of a store stripe, must be a power of 2 */
+#define BLK_EX_STRIPE_SIZE	(64 * 1024)
+
+/* Default number of stripe locks, must be a power of 2 */
+#define BLK_EX_NR_STRIPES	32
+
+/*
+ * Most stripe locks one disk can have.  A request covering every stripe holds
+ * them all at once, which has to stay well inside lockdep's MAX_LOCK_DEPTH and
+ * the 8 bits of preempt count each held rwlock adds to.
+ */
+#define BLK_EX_MAX_STRIPES	32
+
+/* Spans of more stripes than this are serialised on the disk's span_lock */
+#define BLK_EX_STRIPE_NEST	4
+
+/* How a request is processed once it's been handed to us */
+enum {
+	BLK_EX_IO_DEFERRED	= 0,	/* Copy and complete from a work item */
+	BLK_EX_IO_INLINE	= 1,	/* Copy and complete in queue_rq */
+	BLK_EX_IO_TIMED		= 2,	/* Copy in queue_rq, complete from hrtimer */
+};
+
+/* Latency table percentiles are in thousandths of a percent */
+#define BLK_EX_PCT_MAX		100000
+
+/* Most entries allowed in a latency percentile table */
+#define BLK_EX_LAT_TABLE_MAX	16
+
 typedef struct {
-    struct work_struct work;
+    u32 pct;			/* Percentile, 0 - BLK_EX_PCT_MAX */
+    u64 lat_ns;
+} blk_example_lat_point;
+
+/*
+ * Device timing model for one direction (read or write) when io_mode=2.  Each
+ * request is charged lat_ns plus a random amount depending on the
+ * distribution, after waiting for its turn under the bandwidth and IOPS caps.
+ */
+typedef struct {
+    u64 lat_ns;			/* Fixed latency */
+    u64 jitter_ns;		/* Uniform extra latency [0, jitter_ns) */
+    blk_example_lat_point table[BLK_EX_LAT_TABLE_MAX];
+    unsigned int table_len;	/* Use the percentile table if non-zero */
+    unsigned int mbps;		/* Bandwidth cap in MB/s, 0 = unlimited */
+    unsigned int iops;		/* IOPS cap, 0 = unlimited */
+    atomic64_t busy_until;	/* ktime when the caps allow the next I/O */
+} blk_example_emul;
+
+/*
+ * Latency histograms use log2 buckets.  Bucket i counts latencies below
+ * 2^(i + BLK_EX_HIST_SHIFT) ns, the last bucket catches everything longer.
+ */
+#define BLK_EX_HIST_SHIFT	8
+#define BLK_EX_HIST_BUCKETS	24
+
+/* Op classes statistics are kept for */
+enum {
+	BLK_EX_STAT_READ,
+	BLK_EX_STAT_WRITE,
+	BLK_EX_STAT_DISCARD,	/* Discard and write zeroes */
+	BLK_EX_STAT_FLUSH,
+	BLK_EX_NR_STAT_OPS,
+};
+
+/* Per-CPU I/O statistics for one hardware queue */
+typedef struct {
+    u64 ios[BLK_EX_NR_STAT_OPS];
+    u64 bytes[BLK_EX_NR_STAT_OPS];
+    u64 q2c[BLK_EX_NR_STAT_OPS][BLK_EX_HIST_BUCKETS];	/* queue_rq to complete */
+    u64 c2e[BLK_EX_NR_STAT_OPS][BLK_EX_HIST_BUCKETS];	/* complete to end_request */
+    u64 nt_bytes;		/* Written with non-temporal stores */
+} blk_example_stats;
+
+/*
+ * Kinds of fault that can be injected, each with a fault_attr per op class.
+ * The events after them are what .timeout did and only show up in the log.
+ */
+enum {
+	BLK_EX_FAULT_FAIL,	/* Complete with an error without touching the store */
+	BLK_EX_FAULT_DROP,	/* Never complete, leave it to .timeout */
+	BLK_EX_FAULT_DELAY,	/* Do the I/O but complete it delay_ms late */
+	BLK_EX_NR_FAULTS,
+	BLK_EX_EV_REQUEUE = BLK_EX_NR_FAULTS,	/* Timed out, sent back to blk-mq */
+	BLK_EX_EV_ABORT,	/* Timed out too often, failed */
+	BLK_EX_EV_WAIT,		/* Timed out while still being worked on */
+	BLK_EX_NR_EVENTS,
+};
+
+/* Default msecs a delayed request is held back */
+#define BLK_EX_FAULT_DELAY_MS	100
+
+/*
+ * Default times a timed out request is requeued before it's failed, and times
+ * the timer of one that's still being worked on is reset before giving up
+ */
+#define BLK_EX_FAULT_RETRIES	3
+
+/* Msecs before a request .timeout requeued is dispatched again */
+#define BLK_EX_REQUEUE_DELAY_MS	10
+
+/* Entries in the fault event log, must be a power of 2 */
+#define BLK_EX_FAULT_LOG	256
+
+typedef struct {
+    u64 time_ns;
+    sector_t sector;
+    unsigned int bytes;
+    int tag;
+    u8 op;			/* BLK_EX_STAT_* */
+    u8 event;			/* BLK_EX_FAULT_* or BLK_EX_EV_* */
+} blk_example_fault_event;
+
+/* Fault injection state of one disk */
+typedef struct {
+#ifdef CONFIG_FAULT_INJECTION
+    struct fault_attr attr[BLK_EX_NR_STAT_OPS][BLK_EX_NR_FAULTS];
+#endif
+    u32 delay_ms;
+    u32 retries;
+    spinlock_t log_lock;
+    u64 count[BLK_EX_NR_STAT_OPS][BLK_EX_NR_EVENTS];
+    u64 log_seq;		/* Events logged so far */
+    blk_example_fault_event log[BLK_EX_FAULT_LOG];
+} blk_example_faults;
+
+/* Most contiguous requests from a plug list handled under one locking */
+#define BLK_EX_MAX_RUN		32
+
+typedef struct {
+    struct llist_node lnode;	/* On blk_example_deferred list, io_mode=0 */
+    struct list_head list;	/* On blk_example_queue poll_list */
+    u64 queue_ns;		/* When queue_rq saw the request */
+    u64 complete_ns;		/* When we finished with it */
+    struct timerqueue_node tnode;	/* On blk_example_queue pending, io_mode=2 */
     blk_status_t status;
+    bool nt;			/* Copied into the store bypassing the cache */
+    bool dropped;		/* Fault injection dropped it, .timeout owns it */
+    unsigned int retries;	/* Times .timeout requeued it */
+    unsigned int resets;	/* Times .timeout found it still in progress */
+    bool timed_out;		/* .timeout gave up, end with BLK_STS_TIMEOUT */
     struct request *req; /* Back pointer to request */
 } blk_example_cmd;
 
+/* Default zone size in MB for zoned=1 */
+#define BLK_EX_ZONE_SIZE	256
+
+/* One zone of a zoned (host-managed) disk */
+typedef struct {
+    spinlock_t lock;
+    sector_t start;
+    sector_t len;
+    sector_t wp;		/* Write pointer, sequential zones only */
+    enum blk_zone_type type;
+    enum blk_zone_cond cond;
+    unsigned int resetting;	/* Resets in progress without the lock held */
+} blk_example_zone;
+
+/* Per-CPU list of requests waiting for the deferred work, io_mode=0 */
+typedef struct {
+    struct llist_head list;
+    struct work_struct work;
+} blk_example_deferred;
+
+/* Slots in each CPU's cache of decompressed pages, compress=<alg> */
+#define BLK_EX_ZCACHE_SLOTS	16
+
+/* Pages that don't compress below this are stored as they are */
+#define BLK_EX_ZMAX_LEN		(PAGE_SIZE * 3 / 4)
+
+/*
+ * Times an I/O that can sleep waits for reclaim and retries when the
+ * compressed store can't allocate, before failing with BLK_STS_RESOURCE
+ */
+#define BLK_EX_ALLOC_RETRIES	16
+
+/* One page of the compressed store */
+typedef struct {
+    unsigned long handle;	/* zsmalloc object */
+    unsigned int len;		/* Compressed length, PAGE_SIZE if stored raw */
+    u64 seq;			/* Unique for every version written */
+} blk_example_zpage;
+
+/* A decompressed copy of a store page, valid while seq matches the zpage */
+typedef struct {
+    u64 seq;			/* 0 = empty */
+    void *data;
+} blk_example_zslot;
+
+/*
+ * Per-CPU compression context.  Only used with the stripe locks held so
+ * preemption is already off and nothing here needs locking.
+ */
+typedef struct {
+    struct crypto_acomp *tfm;	/* Synchronous, see blk_example_zstore_init() */
+    struct acomp_req *req;
+    void *dst;			/* Compression output, 2 * PAGE_SIZE */
+    void *page;			/* Staging for partial page writes */
+    blk_example_zslot cache[BLK_EX_ZCACHE_SLOTS];
+    u64 comp_nr;
+    u64 comp_ns;
+    u64 decomp_nr[2];		/* Indexed by op_is_write() */
+    u64 decomp_ns[2];
+    u64 cache_hits;
+    u64 cache_misses;
+} blk_example_zcpu;
+
+/* Sparse store mark for pages that need writing back to backing_file */
+#define BLK_EX_DIRTY		XA_MARK_0
+
+/* Default msecs between background writebacks to backing_file */
+#define BLK_EX_WB_MS		5000
+
+/* Most contiguous dirty pages written back with one write */
+#define BLK_EX_WB_PAGES		64
+
+/* One layer of a sparse store, see blk_example_layer_alloc() */
+typedef struct blk_example_layer {
+    struct xarray pages;
+    struct blk_example_layer *parent;	/* Where pages not in this one are */
+    refcount_t ref;		/* Disks and layers stacked on this one */
+    long nr_pages;		/* Pages held once frozen */
+} blk_example_layer;
+
+/* Where store stripes are placed */
+enum {
+	BLK_EX_NUMA_NONE	= 0,	/* Wherever vmalloc() puts it */
+	BLK_EX_NUMA_INTERLEAVE	= 1,	/* Round robin over online nodes */
+	BLK_EX_NUMA_HCTX	= 2,	/* On the node of hctx stripe % nr_queues */
+};
+
+/* How the flat store is mapped, huge_store=<n> */
+enum {
+	BLK_EX_HUGE_NONE	= 0,	/* vmalloc() with 4K PTEs */
+	BLK_EX_HUGE_VMAP	= 1,	/* vmalloc_huge(), PMD mappings if the arch has them */
+	BLK_EX_HUGE_PAGES	= 2,	/* 2 MiB compound pages through the direct map */
+};
+
+/* Per-CPU protection information counters, pi_type=<n> */
+typedef struct {
+    u64 bytes[2];		/* Data covered, indexed by op_is_write() */
+    u64 ns[2];			/* Time spent on PI */
+    u64 generated;		/* Tuples we made up ourselves */
+    u64 guard_err;
+    u64 ref_err;
+} blk_example_pi_stats;
+
+/* Per hardware context state, hctx->driver_data points at one of these */
+typedef struct {
+    spinlock_t poll_lock;
+    struct list_head poll_list;	/* Requests waiting to be reaped by .poll */
+    spinlock_t timer_lock;
+    struct timerqueue_head pending;	/* Requests by completion deadline */
+    struct hrtimer timer;		/* Fires at the earliest deadline */
+    blk_example_stats __percpu *stats;
+    u64 stats_reset_ns;		/* When stats were last cleared */
+    struct dentry *debugfs_dir;
+} blk_example_queue;
+
+/*
+ * The store is split into stripe_size chunks and each chunk hashes to one of
+ * these locks.  Readers share a stripe, writers own it.  Each lock gets its
+ * own cache line so neighbouring stripes don't bounce each other.
+ */
+typedef struct {
+    rwlock_t lock;
+} ____cacheline_aligned_in_smp blk_example_stripe;
+
+/*
+ * Per-CPU stripe lock counters, nr_stripes of them per CPU.  Kept apart from
+ * the locks so readers sharing a stripe don't all write to its cache line.
+ */
+typedef struct {
+    u64 rd_acquired;
+    u64 wr_acquired;
+    u64 rd_contended;
+    u64 wr_contended;
+} blk_example_stripe_stats;
+
 typedef struct {
+    int id;			/* Minor is id + 1 */
+    struct list_head list;	/* On blk_example_devs while powered */
+    char name[DISK_NAME_LEN];
+    struct config_item item;	/* Disks made through configfs */
+    bool powered;		/* The gendisk exists */
+    unsigned int io_mode;
+    unsigned int nr_submit;	/* submit_queues, 0 = pick by io_mode */
+    unsigned int hw_queue_depth;
+    bool shared_tags;
+    const char *compress;	/* Compression algorithm, NULL = none */
+    const char *backing_path;	/* backing_file, NULL = none */
     struct blk_mq_tag_set tagset;
+    struct blk_mq_tag_set *set;	/* &tagset or the shared tag set */
     struct request_queue *rq_queue;
     struct gendisk *disk;
-    void *store;
-    struct mutex store_mutex;
+    unsigned int submit_queues;
+    unsigned int poll_queues;
+    blk_example_deferred __percpu *deferred;
+    blk_example_emul emul[2];	/* Indexed by op_is_write() */
+    u64 capacity;		/* Size of the store in bytes */
+    bool zoned;
+    blk_example_zone *zones;
+    unsigned int nr_zones;
+    unsigned int zone_shift;	/* log2 of zone size in sectors */
+    bool sparse;
+    void *store;		/* Flat store, !sparse */
+    void **chunks;		/* Flat store as per-node stripes, numa_mode */
+    unsigned long nr_chunks;
+    unsigned int chunk_shift;	/* log2 of chunk size, >= stripe_shift */
+    unsigned int huge;		/* huge_store */
+    phys_addr_t dax_phys;	/* dax_mem, flat store is this reserved RAM */
+    u64 dax_size;		/* 0 = no DAX */
+    struct dev_pagemap pgmap;	/* Gives the dax_mem range struct pages */
+    struct dax_device *dax_dev;
+    unsigned long nr_huge_chunks;	/* Chunks that got a compound page */
+    unsigned int numa_mode;
+    unsigned int pi_type;	/* T10 DIF type, 0 = no integrity */
+    enum blk_integrity_checksum pi_csum;
+    struct t10_pi_tuple *pi;	/* One tuple per sector, alongside the store */
+    blk_example_pi_stats __percpu *pi_stats;
+    int *node_map;		/* Stripe to node, repeats every node_map_len */
+    unsigned int node_map_len;
+    u64 __percpu *node_bytes;	/* Per node local and remote bytes copied */
+    blk_example_layer *top;	/* Writable layer of the sparse store */
+    struct xarray *pages;	/* &top->pages, indexed by pgoff */
+    atomic_long_t nr_pages;	/* Pages allocated in the sparse store */
+    bool compressed;		/* Sparse store pages are blk_example_zpage */
+    struct zs_pool *zpool;
+    struct kmem_cache *zpage_cache;
+    blk_example_zcpu __percpu *zcpu;
+    atomic64_t zseq;		/* Last blk_example_zpage seq handed out */
+    atomic_long_t zbytes;	/* Compressed bytes held in zpool */
+    atomic_long_t nr_same;	/* Same filled pages, stored as xa values */
+    struct file *file;		/* backing_file, sparse pages load from it */
+    bool blocking;		/* queue_rq may sleep, BLK_MQ_F_BLOCKING */
+    struct mutex file_lock;	/* Orders file loads, writeback and punching */
+    struct delayed_work wb_work;
+    void *wb_buf;		/* Writeback staging, BLK_EX_WB_PAGES */
+    atomic_long_t file_loads;
+    atomic_long_t file_written;	/* Pages written back */
+    atomic_long_t file_flushes;
+    blk_example_stripe *stripes;
+    blk_example_stripe_stats __percpu *stripe_stats;
+    spinlock_t span_lock;	/* Held over spans of > BLK_EX_STRIPE_NEST */
+    unsigned int nr_stripes;
+    unsigned int stripe_shift;
+    blk_example_faults *faults;
+    struct dentry *debugfs_dir;
+    u64 stats_reset_ns;		/* When aggregate stats were last cleared */
 } blk_example;
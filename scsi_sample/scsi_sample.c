@@ -5,8 +5,24 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/xarray.h>
+#include <linux/hrtimer.h>
+#include <linux/timerqueue.h>
+#include <linux/random.h>
+#include <linux/blk-mq.h>
 #include <linux/stdarg.h>
 #include <linux/device.h>
+#include <linux/scatterlist.h>
+#include <linux/unaligned.h>
+#include <scsi/scsi.h>
+#include <scsi/scsi_proto.h>
+#include <scsi/scsi_common.h>
+#include <scsi/scsi_device.h>
 #include <scsi/scsi_host.h>
 #include <scsi/scsi_cmnd.h>
 
@@ -15,6 +31,82 @@
 unsigned int size_in_mb;
 module_param_named(size_in_mb, size_in_mb, uint, S_IRUGO);
 
+/* Allocate store pages on first write instead of committing them at load */
+static bool sparse;
+module_param(sparse, bool, S_IRUGO);
+MODULE_PARM_DESC(sparse, "Thin provisioned store allocated on first write (default: 0)");
+
+/* Host-wide tag count, shared by all hardware queues */
+static unsigned int can_queue = SCSI_SAMPLE_DEFAULT_CAN_QUEUE;
+module_param(can_queue, uint, S_IRUGO);
+MODULE_PARM_DESC(can_queue, "Host-wide command tags (default: 512, max: 4096)");
+
+static unsigned int cmd_per_lun = SCSI_SAMPLE_DEFAULT_CMD_PER_LUN;
+module_param(cmd_per_lun, uint, S_IRUGO);
+MODULE_PARM_DESC(cmd_per_lun, "Default queue depth per LUN (default: 128)");
+
+/* 0 means one hardware queue per possible CPU */
+static unsigned int submit_queues;
+module_param(submit_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(submit_queues, "Number of hardware queues (default: one per CPU)");
+
+static unsigned int num_tgts = 1;
+module_param(num_tgts, uint, S_IRUGO);
+MODULE_PARM_DESC(num_tgts, "Number of targets (default: 1, max: 128)");
+
+static unsigned int luns_per_tgt = 1;
+module_param(luns_per_tgt, uint, S_IRUGO);
+MODULE_PARM_DESC(luns_per_tgt, "LUNs per target (default: 1, max: 1024)");
+
+/*
+ * Per-LUN overrides, indexed by id * luns_per_tgt + lun.  LUNs past the
+ * end of either list, or with a 0 entry, use size_in_mb and cmd_per_lun.
+ */
+static unsigned int lun_size_mb[SCSI_SAMPLE_MAX_LUN_PARAMS];
+static int num_lun_size_mb;
+module_param_array(lun_size_mb, uint, &num_lun_size_mb, S_IRUGO);
+MODULE_PARM_DESC(lun_size_mb, "Comma separated store size in MB of each LUN, first 256 LUNs only");
+
+static unsigned int lun_qdepth[SCSI_SAMPLE_MAX_LUN_PARAMS];
+static int num_lun_qdepth;
+module_param_array(lun_qdepth, uint, &num_lun_qdepth, S_IRUGO);
+MODULE_PARM_DESC(lun_qdepth, "Comma separated queue depth of each LUN, first 256 LUNs only");
+
+/*
+ * Completion engine.  With every latency and max_iops at 0 commands
+ * complete inline in queuecommand; otherwise they are parked on their
+ * hardware queue's timer until their emulated completion time.  These
+ * can be changed at runtime.
+ */
+static unsigned int read_lat_us;
+module_param(read_lat_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(read_lat_us, "Emulated read latency in us (default: 0)");
+
+static unsigned int write_lat_us;
+module_param(write_lat_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(write_lat_us, "Emulated write latency in us (default: 0)");
+
+static unsigned int other_lat_us;
+module_param(other_lat_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(other_lat_us, "Emulated latency of other commands in us (default: 0)");
+
+static unsigned int jitter_us;
+module_param(jitter_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(jitter_us, "Latency jitter in us, max 1000000 (default: 0)");
+
+static unsigned int jitter_dist = SCSI_SAMPLE_JITTER_UNIFORM;
+module_param(jitter_dist, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(jitter_dist, "Jitter distribution: 0=uniform in [0, jitter_us], 1=exponential with mean jitter_us");
+
+static unsigned int max_iops;
+module_param(max_iops, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_iops, "Host-wide IOPS cap, 0 for none (default: 0)");
+
+/* Timer slack, lets one timer expiry complete a batch of commands */
+static unsigned int batch_us;
+module_param(batch_us, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(batch_us, "Completion timer slack in us (default: 0)");
+
 struct scsi_sample ss;
 
 static const struct bus_type chad_lld_bus;
@@ -24,30 +116,925 @@ static const char ss_proc_name[] = DRIVER_NAME;
 static struct device_driver ss_driverfs_driver = {
     .name = ss_proc_name,
     .bus = &chad_lld_bus,
+    .probe_type = PROBE_PREFER_ASYNCHRONOUS,
 };
 
+static struct scsi_sample_lun *scsi_sample_find_lun(unsigned int id, u64 lun)
+{
+    if (id >= num_tgts || lun >= luns_per_tgt)
+        return NULL;
+    return &ss.luns[id * luns_per_tgt + lun];
+}
+
+/*
+ * Fail the command with CHECK CONDITION and fixed format sense data.
+ */
+static void scsi_sample_sense(struct scsi_cmnd *cmd, u8 key, u8 asc, u8 ascq)
+{
+    scsi_build_sense(cmd, 0, key, asc, ascq);
+}
+
+static void scsi_sample_invalid_field(struct scsi_cmnd *cmd)
+{
+    scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x24, 0x0);
+}
+
+/*
+ * Copy a response built on the stack into the command's data buffer,
+ * truncated to the allocation length from the CDB, and account the rest
+ * as residual.
+ */
+static void scsi_sample_respond(struct scsi_cmnd *cmd, const void *buf,
+    unsigned int len, unsigned int alloc_len)
+{
+    unsigned int copied;
+
+    len = min(len, alloc_len);
+    copied = scsi_sg_copy_from_buffer(cmd, buf, len);
+    scsi_set_resid(cmd, scsi_bufflen(cmd) - copied);
+}
+
+static void scsi_sample_inquiry_vpd(struct scsi_cmnd *cmd, u8 *buf,
+    u8 pdt, unsigned int alloc_len)
+{
+    static const u8 pages[] = { 0x00, 0x80, 0x83, 0xb0, 0xb1, 0xb2 };
+    u8 page = cmd->cmnd[2];
+    unsigned int len;
+
+    buf[0] = pdt;
+    buf[1] = page;
+
+    switch (page) {
+    case 0x00:
+        /* Supported VPD pages */
+        memcpy(&buf[4], pages, sizeof(pages));
+        len = sizeof(pages);
+        break;
+    case 0x80:
+        /* Unit serial number */
+        len = scnprintf(&buf[4], 16, "SS%04x%04x", cmd->device->id,
+            (u32)cmd->device->lun);
+        break;
+    case 0x83:
+        /* Device identification: one T10 vendor id designator */
+        buf[4] = 0x2;       /* code set: ASCII */
+        buf[5] = 0x1;       /* association: LU, type: T10 vendor id */
+        memcpy(&buf[8], "LINUX   ", 8);
+        len = 8 + scnprintf(&buf[16], 32, "%s-%u-%llu", DRIVER_NAME,
+            cmd->device->id, cmd->device->lun);
+        buf[7] = len;
+        len += 4;
+        break;
+    case 0xb0:
+        /* Block limits, WSNZ: WRITE SAME of 0 blocks is not allowed */
+        buf[4] = 0x1;
+        put_unaligned_be32(SCSI_SAMPLE_MAX_XFER, &buf[8]);
+        put_unaligned_be32(SCSI_SAMPLE_MAX_XFER, &buf[12]);
+        put_unaligned_be32(SCSI_SAMPLE_MAX_UNMAP, &buf[20]);
+        put_unaligned_be32(SCSI_SAMPLE_MAX_UNMAP_DESC, &buf[24]);
+        put_unaligned_be32(SCSI_SAMPLE_PAGE_BLOCKS, &buf[28]);
+        put_unaligned_be64(SCSI_SAMPLE_MAX_WRITE_SAME, &buf[36]);
+        len = 0x3c;
+        break;
+    case 0xb1:
+        /* Block device characteristics: non-rotating medium */
+        put_unaligned_be16(1, &buf[4]);
+        len = 0x3c;
+        break;
+    case 0xb2:
+        /*
+         * Logical block provisioning: UNMAP and WRITE SAME(16) with UNMAP,
+         * unmapped blocks read back as zeroes.  The sparse store is thin
+         * provisioned, the flat one is resource provisioned.
+         */
+        buf[5] = 0x80 | 0x40 | 0x04;
+        buf[6] = sparse ? 0x2 : 0x1;
+        len = 4;
+        break;
+    default:
+        scsi_sample_invalid_field(cmd);
+        return;
+    }
+
+    put_unaligned_be16(len, &buf[2]);
+    scsi_sample_respond(cmd, buf, len + 4, alloc_len);
+}
+
+static void scsi_sample_inquiry(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd)
+{
+    unsigned int alloc_len = get_unaligned_be16(&cmd->cmnd[3]);
+    u8 buf[SCSI_SAMPLE_RESP_LEN] = { };
+    u8 pdt = TYPE_DISK;
+
+    /* Peripheral qualifier 3: no logical unit at this LUN */
+    if (!lun)
+        pdt = 0x7f;
+
+    /* CMDDT is obsolete, and a page code without EVPD is an error */
+    if ((cmd->cmnd[1] & 0x2) ||
+        (!(cmd->cmnd[1] & 0x1) && cmd->cmnd[2])) {
+        scsi_sample_invalid_field(cmd);
+        return;
+    }
+
+    if (cmd->cmnd[1] & 0x1) {
+        scsi_sample_inquiry_vpd(cmd, buf, pdt, alloc_len);
+        return;
+    }
+
+    buf[0] = pdt;
+    buf[2] = 0x6;           /* SPC-4 */
+    buf[3] = 0x2;           /* response data format 2 */
+    buf[4] = 36 - 5;        /* additional length */
+    buf[7] = 0x2;           /* CMDQUE */
+    memcpy(&buf[8], "LINUX   ", 8);
+    memcpy(&buf[16], "SCSI_SAMPLE     ", 16);
+    memcpy(&buf[32], "0.1 ", 4);
+
+    scsi_sample_respond(cmd, buf, 36, alloc_len);
+}
+
+static void scsi_sample_read_capacity10(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd)
+{
+    u8 buf[8];
+
+    /* Report 0xffffffff and let sd fall back to READ CAPACITY(16) */
+    put_unaligned_be32(min_t(u64, lun->num_blocks - 1, U32_MAX), &buf[0]);
+    put_unaligned_be32(SCSI_SAMPLE_BLOCK_SIZE, &buf[4]);
+
+    scsi_sample_respond(cmd, buf, sizeof(buf), sizeof(buf));
+}
+
+static void scsi_sample_read_capacity16(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd)
+{
+    unsigned int alloc_len = get_unaligned_be32(&cmd->cmnd[10]);
+    u8 buf[32] = { };
+
+    put_unaligned_be64(lun->num_blocks - 1, &buf[0]);
+    put_unaligned_be32(SCSI_SAMPLE_BLOCK_SIZE, &buf[8]);
+
+    /* LBPME and LBPRZ */
+    buf[14] = 0x80 | 0x40;
+
+    scsi_sample_respond(cmd, buf, sizeof(buf), alloc_len);
+}
+
+/*
+ * The list can be far longer than any response buffer we keep on the
+ * stack, so the entries are copied into the scatterlist one at a time.
+ */
+static void scsi_sample_report_luns(struct scsi_cmnd *cmd)
+{
+    unsigned int alloc_len = get_unaligned_be32(&cmd->cmnd[6]);
+    unsigned int off, copied;
+    struct scsi_lun entry;
+    u8 hdr[8] = { };
+    u64 lun;
+
+    alloc_len = min(alloc_len, scsi_bufflen(cmd));
+
+    /* Every target reports the same set of LUNs */
+    put_unaligned_be32(luns_per_tgt * sizeof(entry), &hdr[0]);
+    copied = sg_pcopy_from_buffer(scsi_sglist(cmd), scsi_sg_count(cmd), hdr,
+        min_t(unsigned int, alloc_len, sizeof(hdr)), 0);
+
+    for (lun = 0, off = sizeof(hdr); lun < luns_per_tgt && off < alloc_len;
+        lun++, off += sizeof(entry)) {
+        int_to_scsilun(lun, &entry);
+        copied += sg_pcopy_from_buffer(scsi_sglist(cmd), scsi_sg_count(cmd),
+            &entry, min_t(unsigned int, alloc_len - off, sizeof(entry)), off);
+    }
+
+    scsi_set_resid(cmd, scsi_bufflen(cmd) - copied);
+}
+
+/*
+ * Append a mode page to buf at offset len and return the new length.
+ * Only the caching and control pages are reported; everything in them is
+ * zero except what sd looks at.
+ */
+static unsigned int scsi_sample_mode_page(u8 *buf, unsigned int len, u8 page)
+{
+    switch (page) {
+    case CACHING_MPAGE:
+        /* Write cache disabled: writes land in the store before completion */
+        buf[len] = CACHING_MPAGE;
+        buf[len + 1] = 0x12;
+        return len + 0x14;
+    case CONTROL_MPAGE:
+        buf[len] = CONTROL_MPAGE;
+        buf[len + 1] = 0xa;
+        return len + 0xc;
+    }
+    return len;
+}
+
+static void scsi_sample_mode_sense(struct scsi_cmnd *cmd)
+{
+    bool ten = cmd->cmnd[0] == MODE_SENSE_10;
+    unsigned int hdr_len = ten ? 8 : 4;
+    unsigned int alloc_len, len;
+    u8 buf[SCSI_SAMPLE_RESP_LEN] = { };
+    u8 page = cmd->cmnd[2] & 0x3f;
+
+    alloc_len = ten ? get_unaligned_be16(&cmd->cmnd[7]) : cmd->cmnd[4];
+
+    /* Saved values are not supported */
+    if ((cmd->cmnd[2] >> 6) == 0x3) {
+        scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x39, 0x0);
+        return;
+    }
+
+    /* No block descriptors, device specific parameter 0 (not WP) */
+    switch (page) {
+    case CACHING_MPAGE:
+    case CONTROL_MPAGE:
+        len = scsi_sample_mode_page(buf, hdr_len, page);
+        break;
+    case 0x3f:
+        len = scsi_sample_mode_page(buf, hdr_len, CACHING_MPAGE);
+        len = scsi_sample_mode_page(buf, len, CONTROL_MPAGE);
+        break;
+    default:
+        scsi_sample_invalid_field(cmd);
+        return;
+    }
+
+    if (ten)
+        put_unaligned_be16(len - 2, &buf[0]);
+    else
+        buf[0] = len - 1;
+
+    scsi_sample_respond(cmd, buf, len, alloc_len);
+}
+
+static void scsi_sample_free_page_rcu(struct rcu_head *head)
+{
+    __free_page(container_of(head, struct page, rcu_head));
+}
+
+/*
+ * Return the sparse store page at idx, allocating and inserting a zeroed
+ * one if there is none yet.  Called under rcu_read_lock() from
+ * queuecommand, so the allocation can't sleep.  GFP_NOWAIT rather than
+ * GFP_ATOMIC, a thin provisioned write isn't worth dipping into the atomic
+ * reserves; on failure the command is retried instead.
+ */
+static struct page *scsi_sample_sparse_page(struct scsi_sample_lun *lun,
+    pgoff_t idx)
+{
+    struct page *page, *old;
+
+    page = xa_load(&lun->pages, idx);
+    if (page)
+        return page;
+
+    page = alloc_page(GFP_NOWAIT | __GFP_ZERO | __GFP_NOWARN);
+    if (!page)
+        return NULL;
+
+    old = xa_cmpxchg(&lun->pages, idx, NULL, page,
+        GFP_NOWAIT | __GFP_NOWARN);
+    if (old) {
+        /* Lost the race to another writer, or out of memory */
+        __free_page(page);
+        return xa_is_err(old) ? NULL : old;
+    }
+
+    atomic_long_inc(&lun->nr_pages);
+    return page;
+}
+
+/*
+ * Copy between the command's scatterlist and the sparse store one page
+ * at a time.  Reads of pages that were never written see the zero page.
+ * Pages are only freed after an RCU grace period, so one unmapped under
+ * us stays valid until we are done with it.
+ */
+static int scsi_sample_sparse_rw(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd, u64 pos, size_t len, bool write,
+    unsigned int *copied)
+{
+    struct sg_mapping_iter miter;
+    unsigned int flags = SG_MITER_ATOMIC;
+    struct page *page;
+    size_t off, n;
+    void *addr;
+    int rval = 0;
+
+    flags |= write ? SG_MITER_FROM_SG : SG_MITER_TO_SG;
+    sg_miter_start(&miter, scsi_sglist(cmd), scsi_sg_count(cmd), flags);
+
+    *copied = 0;
+    rcu_read_lock();
+    while (len && sg_miter_next(&miter)) {
+        for (off = 0; off < miter.length && len; off += n) {
+            n = min3(miter.length - off, PAGE_SIZE - offset_in_page(pos), len);
+
+            if (write)
+                page = scsi_sample_sparse_page(lun, pos >> PAGE_SHIFT);
+            else
+                page = xa_load(&lun->pages, pos >> PAGE_SHIFT);
+
+            if (page)
+                addr = page_address(page) + offset_in_page(pos);
+            else if (!write)
+                addr = page_address(ZERO_PAGE(0));
+            else {
+                rval = -ENOMEM;
+                goto out;
+            }
+
+            if (write)
+                memcpy(addr, miter.addr + off, n);
+            else
+                memcpy(miter.addr + off, addr, n);
+
+            pos += n;
+            len -= n;
+            *copied += n;
+        }
+    }
+out:
+    rcu_read_unlock();
+    sg_miter_stop(&miter);
+    return rval;
+}
+
+/* Free the sparse store pages first..last */
+static void scsi_sample_sparse_drop(struct scsi_sample_lun *lun,
+    pgoff_t first, pgoff_t last)
+{
+    struct page *page;
+    unsigned long idx;
+
+    xa_for_each_range(&lun->pages, idx, page, first, last) {
+        if (xa_cmpxchg(&lun->pages, idx, page, NULL, 0) != page)
+            continue;
+        atomic_long_dec(&lun->nr_pages);
+        call_rcu(&page->rcu_head, scsi_sample_free_page_rcu);
+    }
+}
+
+/*
+ * Unmap num blocks at lba.  The sparse store gives whole pages back and
+ * zeroes partial ones; the flat store can only zero.
+ */
+static void scsi_sample_discard(struct scsi_sample_lun *lun, u64 lba, u32 num)
+{
+    u64 pos = lba << SCSI_SAMPLE_BLOCK_SHIFT;
+    u64 end = (lba + num) << SCSI_SAMPLE_BLOCK_SHIFT;
+    struct page *page;
+    size_t n;
+
+    this_cpu_inc(lun->stats->unmaps);
+
+    if (lun->backing_store) {
+        memset(lun->backing_store + pos, 0, end - pos);
+        return;
+    }
+
+    while (pos < end) {
+        if (!offset_in_page(pos) && end - pos >= PAGE_SIZE) {
+            scsi_sample_sparse_drop(lun, pos >> PAGE_SHIFT,
+                (end >> PAGE_SHIFT) - 1);
+            pos = round_down(end, PAGE_SIZE);
+            continue;
+        }
+
+        n = min_t(u64, end - pos, PAGE_SIZE - offset_in_page(pos));
+        rcu_read_lock();
+        page = xa_load(&lun->pages, pos >> PAGE_SHIFT);
+        if (page)
+            memset(page_address(page) + offset_in_page(pos), 0, n);
+        rcu_read_unlock();
+        pos += n;
+    }
+}
+
+static bool scsi_sample_lba_ok(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd, u64 lba, u32 num)
+{
+    if (lba > lun->num_blocks || num > lun->num_blocks - lba) {
+        scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x21, 0x0);
+        return false;
+    }
+    return true;
+}
+
+static void scsi_sample_unmap(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd)
+{
+    unsigned int len = get_unaligned_be16(&cmd->cmnd[7]);
+    unsigned int i, ndesc;
+    u8 hdr[8], desc[16];
+    u64 lba;
+    u32 num;
+
+    len = min(len, scsi_bufflen(cmd));
+    if (len < sizeof(hdr))
+        return;
+
+    sg_pcopy_to_buffer(scsi_sglist(cmd), scsi_sg_count(cmd), hdr,
+        sizeof(hdr), 0);
+    ndesc = min_t(unsigned int, get_unaligned_be16(&hdr[2]),
+        len - sizeof(hdr)) / sizeof(desc);
+    if (ndesc > SCSI_SAMPLE_MAX_UNMAP_DESC) {
+        scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x26, 0x0);
+        return;
+    }
+
+    for (i = 0; i < ndesc; i++) {
+        sg_pcopy_to_buffer(scsi_sglist(cmd), scsi_sg_count(cmd), desc,
+            sizeof(desc), sizeof(hdr) + i * sizeof(desc));
+        lba = get_unaligned_be64(&desc[0]);
+        num = get_unaligned_be32(&desc[8]);
+
+        if (num > SCSI_SAMPLE_MAX_UNMAP) {
+            scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x26, 0x0);
+            return;
+        }
+        if (!scsi_sample_lba_ok(lun, cmd, lba, num))
+            return;
+
+        scsi_sample_discard(lun, lba, num);
+    }
+}
+
+/*
+ * WRITE SAME(16).  With UNMAP the range is discarded, which is what sd uses
+ * for discard and write zeroes once LBPWS and LBPRZ are set.  Without it the
+ * one block of data out, zeroes for a REQ_NOUNMAP zeroout, is copied into
+ * every block of the range.  That all happens in one RCU read-side section
+ * in queuecommand, which can't sleep, so the range is capped at
+ * SCSI_SAMPLE_MAX_WRITE_SAME.  Returns SCSI_MLQUEUE_HOST_BUSY like
+ * scsi_sample_rw().
+ */
+static int scsi_sample_write_same16(struct scsi_sample_lun *lun,
+    struct scsi_cmnd *cmd)
+{
+    u64 lba = get_unaligned_be64(&cmd->cmnd[2]);
+    u32 num = get_unaligned_be32(&cmd->cmnd[10]);
+    struct scsi_sample_lun_stats *stats;
+    void *first = NULL, *addr;
+    struct page *page;
+    u64 pos;
+    u32 i;
+
+    /* WSNZ is set in the block limits page */
+    if (!num || num > SCSI_SAMPLE_MAX_WRITE_SAME) {
+        scsi_sample_invalid_field(cmd);
+        return 0;
+    }
+    if (!scsi_sample_lba_ok(lun, cmd, lba, num))
+        return 0;
+
+    if (cmd->cmnd[1] & 0x8) {
+        scsi_sample_discard(lun, lba, num);
+        return 0;
+    }
+
+    if (scsi_bufflen(cmd) < SCSI_SAMPLE_BLOCK_SIZE) {
+        scsi_sample_invalid_field(cmd);
+        return 0;
+    }
+
+    /* The first block comes from the scatterlist, the rest copy it */
+    rcu_read_lock();
+    for (i = 0; i < num; i++) {
+        pos = (lba + i) << SCSI_SAMPLE_BLOCK_SHIFT;
+        if (lun->backing_store) {
+            addr = lun->backing_store + pos;
+        } else {
+            page = scsi_sample_sparse_page(lun, pos >> PAGE_SHIFT);
+            if (!page) {
+                rcu_read_unlock();
+                return SCSI_MLQUEUE_HOST_BUSY;
+            }
+            addr = page_address(page) + offset_in_page(pos);
+        }
+
+        if (first) {
+            memcpy(addr, first, SCSI_SAMPLE_BLOCK_SIZE);
+        } else {
+            sg_pcopy_to_buffer(scsi_sglist(cmd), scsi_sg_count(cmd), addr,
+                SCSI_SAMPLE_BLOCK_SIZE, 0);
+            first = addr;
+        }
+    }
+    rcu_read_unlock();
+
+    scsi_set_resid(cmd, scsi_bufflen(cmd) - SCSI_SAMPLE_BLOCK_SIZE);
+
+    stats = get_cpu_ptr(lun->stats);
+    stats->writes++;
+    stats->write_bytes += (u64)num << SCSI_SAMPLE_BLOCK_SHIFT;
+    put_cpu_ptr(lun->stats);
+    return 0;
+}
+
+/*
+ * READ and WRITE (6, 10 and 16).  Data moves directly between the backing
+ * store and the command's scatterlist, there is no bounce buffer.
+ * Returns SCSI_MLQUEUE_HOST_BUSY if a sparse store page couldn't be
+ * allocated, so the midlayer retries the command later.
+ */
+static int scsi_sample_rw(struct scsi_sample_lun *lun, struct scsi_cmnd *cmd)
+{
+    struct scsi_sample_lun_stats *stats;
+    const u8 *cdb = cmd->cmnd;
+    bool write = false;
+    unsigned int copied;
+    u32 num;
+    u64 lba;
+    void *addr;
+    size_t len;
+
+    switch (cdb[0]) {
+    case WRITE_6:
+        write = true;
+        fallthrough;
+    case READ_6:
+        lba = get_unaligned_be24(&cdb[1]) & 0x1fffff;
+        num = cdb[4] ? cdb[4] : 256;
+        break;
+    case WRITE_10:
+        write = true;
+        fallthrough;
+    case READ_10:
+        lba = get_unaligned_be32(&cdb[2]);
+        num = get_unaligned_be16(&cdb[7]);
+        break;
+    case WRITE_16:
+        write = true;
+        fallthrough;
+    default:
+        /* READ_16 */
+        lba = get_unaligned_be64(&cdb[2]);
+        num = get_unaligned_be32(&cdb[10]);
+        break;
+    }
+
+    if (!scsi_sample_lba_ok(lun, cmd, lba, num))
+        return 0;
+
+    len = (size_t)num << SCSI_SAMPLE_BLOCK_SHIFT;
+    if (len > scsi_bufflen(cmd)) {
+        scsi_sample_invalid_field(cmd);
+        return 0;
+    }
+
+    if (!lun->backing_store) {
+        if (scsi_sample_sparse_rw(lun, cmd, lba << SCSI_SAMPLE_BLOCK_SHIFT,
+            len, write, &copied))
+            return SCSI_MLQUEUE_HOST_BUSY;
+    } else {
+        addr = lun->backing_store + (lba << SCSI_SAMPLE_BLOCK_SHIFT);
+        if (write)
+            copied = scsi_sg_copy_to_buffer(cmd, addr, len);
+        else
+            copied = scsi_sg_copy_from_buffer(cmd, addr, len);
+    }
+
+    scsi_set_resid(cmd, scsi_bufflen(cmd) - copied);
+
+    stats = get_cpu_ptr(lun->stats);
+    if (write) {
+        stats->writes++;
+        stats->write_bytes += copied;
+    } else {
+        stats->reads++;
+        stats->read_bytes += copied;
+    }
+    put_cpu_ptr(lun->stats);
+    return 0;
+}
+
+/*
+ * Exponentially distributed delay with the given mean.  -ln(u) for a
+ * uniform u in (0, 1] is (32 - log2(r)) * ln(2) with r = u * 2^32, and
+ * log2(r) is approximated by its integer part plus a linear fit of the
+ * mantissa, all in 16.16 fixed point.
+ */
+static u64 scsi_sample_exp_ns(u64 mean)
+{
+    u32 r = get_random_u32() | 1;
+    unsigned int k = ilog2(r);
+    u64 frac = ((u64)(r - (1U << k)) << 16) >> k;
+    u64 nlog2 = ((u64)(32 - k) << 16) - frac;
+
+    /* ln(2) = 45426 / 2^16 */
+    return ((mean * nlog2) >> 16) * 45426 >> 16;
+}
+
+/* Emulated service time of cmd in ns, 0 to complete it inline */
+static u64 scsi_sample_latency_ns(struct scsi_cmnd *cmd)
+{
+    u64 lat, jitter = min(READ_ONCE(jitter_us), 1000000U) * NSEC_PER_USEC;
+
+    switch (req_op(scsi_cmd_to_rq(cmd))) {
+    case REQ_OP_READ:
+        lat = READ_ONCE(read_lat_us);
+        break;
+    case REQ_OP_WRITE:
+        lat = READ_ONCE(write_lat_us);
+        break;
+    default:
+        lat = READ_ONCE(other_lat_us);
+        break;
+    }
+    lat *= NSEC_PER_USEC;
+
+    if (lat && jitter) {
+        if (READ_ONCE(jitter_dist) == SCSI_SAMPLE_JITTER_EXP)
+            lat += scsi_sample_exp_ns(jitter);
+        else
+            lat += get_random_u32_below(jitter + 1);
+    }
+    return lat;
+}
+
+static void scsi_sample_queue_arm(struct scsi_sample_queue *q, ktime_t expires)
+{
+    hrtimer_start_range_ns(&q->timer, expires,
+        (u64)READ_ONCE(batch_us) * NSEC_PER_USEC,
+        HRTIMER_MODE_ABS_PINNED_SOFT);
+}
+
+/*
+ * Complete cmd, either right away or by parking it on its hardware
+ * queue until its emulated completion time.  The timer is pinned to the
+ * CPU that armed it, which is the submitting CPU for the default blk-mq
+ * mapping, so deferred completions stay there too.
+ */
+static void scsi_sample_complete(struct scsi_cmnd *cmd)
+{
+    struct scsi_sample_cmd *priv = scsi_cmd_priv(cmd);
+    unsigned int iops = READ_ONCE(max_iops);
+    struct scsi_sample_queue *q;
+    unsigned long flags;
+    ktime_t now, expires;
+    s64 slot, old;
+    u64 lat;
+
+    lat = scsi_sample_latency_ns(cmd);
+    if (!lat && !iops) {
+        scsi_done(cmd);
+        return;
+    }
+
+    q = &ss.queues[blk_mq_unique_tag_to_hwq(
+        blk_mq_unique_tag(scsi_cmd_to_rq(cmd)))];
+    priv->q = q;
+
+    now = ktime_get();
+    expires = ktime_add_ns(now, lat);
+
+    /*
+     * Claim the next completion slot of the host-wide cap.  Slots are
+     * 1s / max_iops apart and idle time isn't banked.
+     */
+    if (iops) {
+        old = atomic64_read(&ss.next_slot);
+        do {
+            slot = max_t(s64, old, ktime_to_ns(now));
+        } while (!atomic64_try_cmpxchg(&ss.next_slot, &old,
+            slot + div_u64(NSEC_PER_SEC, iops)));
+        expires = max(expires, ns_to_ktime(slot));
+    }
+
+    spin_lock_irqsave(&q->lock, flags);
+    priv->node.expires = expires;
+    if (timerqueue_add(&q->pending, &priv->node))
+        scsi_sample_queue_arm(q, expires);
+    spin_unlock_irqrestore(&q->lock, flags);
+}
+
+/*
+ * Runs in softirq context: complete every command whose time has come,
+ * as one batch, and re-arm for the next one.
+ */
+static enum hrtimer_restart scsi_sample_queue_timer(struct hrtimer *timer)
+{
+    struct scsi_sample_queue *q =
+        container_of(timer, struct scsi_sample_queue, timer);
+    struct scsi_sample_cmd *priv, *tmp;
+    struct timerqueue_node *node;
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    LIST_HEAD(done);
+
+    spin_lock_irqsave(&q->lock, flags);
+    while ((node = timerqueue_getnext(&q->pending)) &&
+        node->expires <= now) {
+        timerqueue_del(&q->pending, node);
+        priv = container_of(node, struct scsi_sample_cmd, node);
+        list_add_tail(&priv->list, &done);
+    }
+
+    /* Restarted under the lock so it can't race with queuecommand */
+    if (node)
+        scsi_sample_queue_arm(q, node->expires);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    list_for_each_entry_safe(priv, tmp, &done, list)
+        scsi_done(priv->cmd);
+
+    return HRTIMER_NORESTART;
+}
+
+static int scsi_sample_init_cmd_priv(struct Scsi_Host *shost,
+    struct scsi_cmnd *cmd)
+{
+    struct scsi_sample_cmd *priv = scsi_cmd_priv(cmd);
+
+    priv->cmd = cmd;
+    timerqueue_init(&priv->node);
+    return 0;
+}
+
+/*
+ * A command can only time out while parked on a queue.  Take it off so
+ * the timer doesn't complete it behind the error handler's back.
+ *
+ * If the timer got there first the command is already on its done list
+ * and will still be passed to scsi_done().  That late call is harmless
+ * only because the command timed out: the midlayer set
+ * SCMD_STATE_COMPLETE when it did, and scsi_done() ignores a command
+ * with that bit set.  There was nothing left for us to abort, so just
+ * report SUCCESS.
+ */
+static int scsi_sample_abort(struct scsi_cmnd *cmd)
+{
+    struct scsi_sample_cmd *priv = scsi_cmd_priv(cmd);
+    struct scsi_sample_queue *q = priv->q;
+    unsigned long flags;
+    bool parked;
+
+    if (!q)
+        return SUCCESS;
+
+    spin_lock_irqsave(&q->lock, flags);
+    parked = !RB_EMPTY_NODE(&priv->node.node);
+    if (parked)
+        timerqueue_del(&q->pending, &priv->node);
+    spin_unlock_irqrestore(&q->lock, flags);
+
+    if (parked)
+        SS_DEBUG_INFO("aborted opcode=0x%x", cmd->cmnd[0]);
+    return SUCCESS;
+}
+
 static int scsi_sample_queuecommand(struct Scsi_Host *shost, struct scsi_cmnd *cmd)
 {
-    SS_DEBUG_INFO("cmd opcode=0x%x", cmd->cmnd[0]);
+    struct scsi_sample_lun *lun = cmd->device->hostdata;
+    struct scsi_sample_cmd *priv = scsi_cmd_priv(cmd);
+    int rval;
+
+    priv->q = NULL;
+    cmd->result = 0;
+    scsi_set_resid(cmd, 0);
+
+    /* LUNs we don't emulate only answer INQUIRY and REPORT LUNS */
+    if (!lun && cmd->cmnd[0] != INQUIRY && cmd->cmnd[0] != REPORT_LUNS) {
+        scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x25, 0x0);
+        goto done;
+    }
+
+    switch (cmd->cmnd[0]) {
+    case TEST_UNIT_READY:
+    case SYNCHRONIZE_CACHE:
+    case SYNCHRONIZE_CACHE_16:
+    case START_STOP:
+        break;
+    case INQUIRY:
+        scsi_sample_inquiry(lun, cmd);
+        break;
+    case READ_CAPACITY:
+        scsi_sample_read_capacity10(lun, cmd);
+        break;
+    case SERVICE_ACTION_IN_16:
+        if ((cmd->cmnd[1] & 0x1f) != SAI_READ_CAPACITY_16)
+            goto unsupported;
+        scsi_sample_read_capacity16(lun, cmd);
+        break;
+    case REPORT_LUNS:
+        scsi_sample_report_luns(cmd);
+        break;
+    case MODE_SENSE:
+    case MODE_SENSE_10:
+        scsi_sample_mode_sense(cmd);
+        break;
+    case READ_6:
+    case READ_10:
+    case READ_16:
+    case WRITE_6:
+    case WRITE_10:
+    case WRITE_16:
+        rval = scsi_sample_rw(lun, cmd);
+        if (rval)
+            return rval;
+        break;
+    case UNMAP:
+        scsi_sample_unmap(lun, cmd);
+        break;
+    case WRITE_SAME_16:
+        rval = scsi_sample_write_same16(lun, cmd);
+        if (rval)
+            return rval;
+        break;
+    default:
+unsupported:
+        SS_DEBUG_DBG("%u:%llu: unsupported opcode=0x%x", cmd->device->id,
+            cmd->device->lun, cmd->cmnd[0]);
+        scsi_sample_sense(cmd, ILLEGAL_REQUEST, 0x20, 0x0);
+        break;
+    }
+
+    if (cmd->result && lun)
+        this_cpu_inc(lun->stats->errors);
+done:
+    scsi_sample_complete(cmd);
+    return 0;
+}
+
+static int scsi_sample_sdev_init(struct scsi_device *sdev)
+{
+    /* NULL for LUNs the scan probes but we don't emulate */
+    sdev->hostdata = scsi_sample_find_lun(sdev->id, sdev->lun);
+    return 0;
+}
+
+static int scsi_sample_sdev_configure(struct scsi_device *sdev,
+    struct queue_limits *lim)
+{
+    struct scsi_sample_lun *lun = sdev->hostdata;
 
-    // Return DID_NO_CONNECT for now as we can't process any commands
-    cmd->result = DID_NO_CONNECT << 16;
-    scsi_done(cmd);
+    if (lun)
+        scsi_change_queue_depth(sdev, lun->queue_depth);
     return 0;
 }
 
+static ssize_t sample_stats_show(struct device *dev,
+    struct device_attribute *attr, char *buf)
+{
+    struct scsi_sample_lun *lun = to_scsi_device(dev)->hostdata;
+    struct scsi_sample_lun_stats sum = { };
+    int cpu;
+
+    if (!lun)
+        return -ENODEV;
+
+    for_each_possible_cpu(cpu) {
+        struct scsi_sample_lun_stats *st = per_cpu_ptr(lun->stats, cpu);
+
+        sum.reads += st->reads;
+        sum.writes += st->writes;
+        sum.read_bytes += st->read_bytes;
+        sum.write_bytes += st->write_bytes;
+        sum.unmaps += st->unmaps;
+        sum.errors += st->errors;
+    }
+
+    return sysfs_emit(buf,
+        "reads %llu\nwrites %llu\nread_bytes %llu\nwrite_bytes %llu\n"
+        "unmaps %llu\nerrors %llu\nblocks %llu\nallocated_bytes %llu\n",
+        sum.reads, sum.writes, sum.read_bytes, sum.write_bytes, sum.unmaps,
+        sum.errors, lun->num_blocks, lun->backing_store ?
+        lun->num_blocks << SCSI_SAMPLE_BLOCK_SHIFT :
+        (u64)atomic_long_read(&lun->nr_pages) << PAGE_SHIFT);
+}
+static DEVICE_ATTR_RO(sample_stats);
+
+static struct attribute *scsi_sample_sdev_attrs[] = {
+    &dev_attr_sample_stats.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(scsi_sample_sdev);
+
 static const struct scsi_host_template scsi_sample_template = {
 	.name =			"SCSI_SAMPLE",
 	.queuecommand =		scsi_sample_queuecommand,
-	.can_queue =		1,
-	.this_id =		7,
+	.init_cmd_priv =	scsi_sample_init_cmd_priv,
+	.eh_abort_handler =	scsi_sample_abort,
+	.cmd_size =		sizeof(struct scsi_sample_cmd),
+	.sdev_init =		scsi_sample_sdev_init,
+	.sdev_configure =	scsi_sample_sdev_configure,
+	.sdev_groups =		scsi_sample_sdev_groups,
+	.change_queue_depth =	scsi_change_queue_depth,
+	.can_queue =		SCSI_SAMPLE_DEFAULT_CAN_QUEUE,
+	.this_id =		-1,
 	.sg_tablesize =		SG_MAX_SEGMENTS,
-	.cmd_per_lun =		1,
+	.cmd_per_lun =		SCSI_SAMPLE_DEFAULT_CMD_PER_LUN,
 	.max_sectors =		-1U,
 	.max_segment_size =	-1U,
 	.module =		THIS_MODULE,
 	.skip_settle_delay =	1,
 	.track_queue_depth =	0,
+	.host_tagset =		1,
 };
 
 static void scsi_sample_device_release(struct device *dev)
@@ -55,9 +1042,148 @@ static void scsi_sample_device_release(struct device *dev)
     /* Could use to free memory for specific adapter instance if wanted */
 }
 
+static void scsi_sample_free_luns(void)
+{
+    struct page *page;
+    unsigned long idx;
+    unsigned int i;
+
+    /* Wait for pages freed by UNMAP before tearing down the rest */
+    rcu_barrier();
+
+    for (i = 0; i < ss.num_luns; i++) {
+        xa_for_each(&ss.luns[i].pages, idx, page)
+            __free_page(page);
+        xa_destroy(&ss.luns[i].pages);
+        vfree(ss.luns[i].backing_store);
+        free_percpu(ss.luns[i].stats);
+    }
+    kvfree(ss.luns);
+}
+
+/* Store size in MB of LUN index i */
+static unsigned int scsi_sample_lun_mb(unsigned int i)
+{
+    if (i < num_lun_size_mb && lun_size_mb[i])
+        return lun_size_mb[i];
+    return size_in_mb;
+}
+
+/*
+ * Allocate every LUN of the topology up front along with its backing
+ * store, so nothing is allocated on the command path.
+ */
+static int scsi_sample_alloc_luns(void)
+{
+    struct scsi_sample_lun *lun;
+    u64 backing_store_size, total_mb = 0;
+    unsigned int i, mb;
+
+    ss.num_luns = num_tgts * luns_per_tgt;
+
+    if ((num_lun_size_mb || num_lun_qdepth) &&
+        ss.num_luns > SCSI_SAMPLE_MAX_LUN_PARAMS)
+        SS_DEBUG_WARN("lun_size_mb and lun_qdepth only cover the first %u "
+            "of %u LUNs, the rest use size_in_mb and cmd_per_lun",
+            SCSI_SAMPLE_MAX_LUN_PARAMS, ss.num_luns);
+
+    /*
+     * Flat stores are committed in full right here, one LUN after another.
+     * Refuse a topology that would take more than half of RAM rather than
+     * grind through it and leave the system without memory.
+     */
+    if (!sparse) {
+        for (i = 0; i < ss.num_luns; i++)
+            total_mb += scsi_sample_lun_mb(i);
+        if (total_mb > (totalram_pages() >> (20 - PAGE_SHIFT)) / 2) {
+            SS_DEBUG_WARN("%llu MB of flat stores is more than half of RAM, "
+                "use sparse=1 or smaller stores", total_mb);
+            return -ENOMEM;
+        }
+        SS_DEBUG_INFO("Allocating %llu MB of flat stores", total_mb);
+    }
+
+    ss.luns = kvcalloc(ss.num_luns, sizeof(*ss.luns), GFP_KERNEL);
+    if (!ss.luns)
+        return -ENOMEM;
+
+    for (i = 0; i < ss.num_luns; i++) {
+        lun = &ss.luns[i];
+        lun->id = i / luns_per_tgt;
+        lun->lun = i % luns_per_tgt;
+        xa_init(&lun->pages);
+
+        mb = scsi_sample_lun_mb(i);
+
+        lun->queue_depth = cmd_per_lun;
+        if (i < num_lun_qdepth && lun_qdepth[i])
+            lun->queue_depth = min(lun_qdepth[i], can_queue);
+
+        lun->stats = alloc_percpu(struct scsi_sample_lun_stats);
+        if (!lun->stats) {
+            ss.num_luns = i + 1;
+            goto free_luns;
+        }
+
+        backing_store_size = (u64)mb << 20;
+        lun->num_blocks = backing_store_size >> SCSI_SAMPLE_BLOCK_SHIFT;
+        if (sparse)
+            continue;
+
+        /*
+         * Allocate the backing store.  Use vmalloc since we may be
+         * allocating a lot of memory.
+         */
+        lun->backing_store = vzalloc(backing_store_size);
+        if (!lun->backing_store) {
+            SS_DEBUG_WARN("%u:%llu: store allocation of %u MB failed",
+                lun->id, lun->lun, mb);
+            ss.num_luns = i + 1;
+            goto free_luns;
+        }
+        cond_resched();
+    }
+
+    SS_DEBUG_INFO("%u targets x %u LUNs", num_tgts, luns_per_tgt);
+    return 0;
+
+free_luns:
+    scsi_sample_free_luns();
+    return -ENOMEM;
+}
+
+static int scsi_sample_alloc_queues(void)
+{
+    struct scsi_sample_queue *q;
+    unsigned int i;
+
+    ss.queues = kcalloc(submit_queues, sizeof(*ss.queues), GFP_KERNEL);
+    if (!ss.queues)
+        return -ENOMEM;
+    atomic64_set(&ss.next_slot, 0);
+
+    for (i = 0; i < submit_queues; i++) {
+        q = &ss.queues[i];
+        spin_lock_init(&q->lock);
+        timerqueue_init_head(&q->pending);
+        hrtimer_setup(&q->timer, scsi_sample_queue_timer, CLOCK_MONOTONIC,
+            HRTIMER_MODE_ABS_PINNED_SOFT);
+    }
+    return 0;
+}
+
+/* The host is gone by now, so nothing is left parked on the queues */
+static void scsi_sample_free_queues(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < submit_queues; i++)
+        hrtimer_cancel(&ss.queues[i].timer);
+    kfree(ss.queues);
+}
+
 static int __init scsi_sample_init(void)
 {
-    uint32_t backing_store_size;
     int retval;
 
     SS_DEBUG_INFO("Module version %s", SCSI_SAMPLE_VERSION);
@@ -67,24 +1193,30 @@ static int __init scsi_sample_init(void)
         size_in_mb = SCSI_SAMPLE_DEFAULT_SIZE;
     }
 
-    /*
-     * Allocate the backing store.  Use vmalloc since we may be
-     * allocating a lot of memory.
-     */
-    backing_store_size = size_in_mb * (1024 * 1024);
-    SS_DEBUG_INFO("Backing store size = %u", backing_store_size);
-    ss.backing_store = vmalloc(backing_store_size);
-	if (!ss.backing_store) {
-		SS_DEBUG_INFO("%s(): store is NULL", __func__);
-		return -ENOMEM;
-	}
+    /* Sanity check queueing module parameters */
+    can_queue = clamp(can_queue, 1U, SCSI_SAMPLE_MAX_CAN_QUEUE);
+    cmd_per_lun = clamp(cmd_per_lun, 1U, can_queue);
+    if (submit_queues == 0 || submit_queues > nr_cpu_ids)
+        submit_queues = nr_cpu_ids;
+
+    /* Sanity check topology module parameters */
+    num_tgts = clamp(num_tgts, 1U, SCSI_SAMPLE_MAX_TGTS);
+    luns_per_tgt = clamp(luns_per_tgt, 1U, SCSI_SAMPLE_MAX_LUNS_PER_TGT);
+
+    retval = scsi_sample_alloc_luns();
+    if (retval)
+        return retval;
+
+    retval = scsi_sample_alloc_queues();
+    if (retval)
+        goto free_luns;
 
     /* Creates directory under /sys/devices */
     ss.fake_root_device = root_device_register("chad_root_dev");
     if (IS_ERR(ss.fake_root_device)) {
         SS_DEBUG_WARN("Error creating root device");
         retval = -ENOMEM;
-        goto free_backing_store;
+        goto free_queues;
     }
 
     /* Create a device subsystem */
@@ -126,8 +1258,10 @@ bus_unregister:
     bus_unregister(&chad_lld_bus);
 root_unregister:
     root_device_unregister(ss.fake_root_device);
-free_backing_store:
-    vfree(ss.backing_store);
+free_queues:
+    scsi_sample_free_queues();
+free_luns:
+    scsi_sample_free_luns();
 
     return retval;
 }
@@ -146,8 +1280,11 @@ static void __exit scsi_sample_exit(void)
     /* Unregister root device */
     root_device_unregister(ss.fake_root_device);
 
-    /* Free backing store*/
-    vfree(ss.backing_store);
+    /* Stop the completion engine */
+    scsi_sample_free_queues();
+
+    /* Free LUNs and their backing stores */
+    scsi_sample_free_luns();
 
     SS_DEBUG_INFO("Module unloaded");
 }
@@ -171,12 +1308,23 @@ static int scsi_sample_probe(struct device *dev)
     /* Set dma boundary to PAGE_SIZE - 1 so we don't get multiple pages */
     ss.shost->dma_boundary = PAGE_SIZE - 1;
 
-    /* No SCSI multiqueue */
-    ss.shost->nr_hw_queues = 1;
+    /*
+     * One hardware queue per CPU sharing a single host-wide tagset, so
+     * can_queue bounds the commands outstanding across all queues.  The
+     * default blk-mq CPU mapping is used and commands complete either
+     * inline in queuecommand or from a timer pinned to the submitting
+     * CPU, so completions always run there.
+     */
+    ss.shost->nr_hw_queues = submit_queues;
+    ss.shost->can_queue = can_queue;
+    ss.shost->cmd_per_lun = cmd_per_lun;
 
-    /* Just one target and lun */
-    ss.shost->max_id = 1;
-    ss.shost->max_lun = 1;
+    /*
+     * Targets 0..num_tgts-1 on channel 0.  The host has no id of its own
+     * (this_id is -1) so every target id is scanned.
+     */
+    ss.shost->max_id = num_tgts;
+    ss.shost->max_lun = luns_per_tgt;
 
     /* Add the host to the mid-layer*/
     rval = scsi_add_host(ss.shost, &ss.dev);
@@ -187,7 +1335,11 @@ static int scsi_sample_probe(struct device *dev)
         goto free_scsi_host;
     }
 
-    /* Start ur scanning! */
+    /*
+     * Start ur scanning!  With async scanning (scsi_mod.scan=async) this
+     * returns right away, and REPORT LUNS means each target costs one
+     * command rather than an INQUIRY sweep of every possible LUN.
+     */
     scsi_scan_host(ss.shost);
 
     return 0;
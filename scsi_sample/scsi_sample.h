@@ -1,10 +1,23 @@
 #ifndef _SCSI_SAMPLE_H_
 #define _SCSI_SAMPLE_H_
+#include <linux/xarray.h>
+#include <linux/hrtimer.h>
+#include <linux/timerqueue.h>
 #include <scsi/scsi_host.h>
 
 /* Default size in MB */
 #define SCSI_SAMPLE_DEFAULT_SIZE        100
 
+/* Default host-wide and per-LUN queue depths */
+#define SCSI_SAMPLE_DEFAULT_CAN_QUEUE   512
+#define SCSI_SAMPLE_DEFAULT_CMD_PER_LUN 128
+#define SCSI_SAMPLE_MAX_CAN_QUEUE       4096
+
+/* Topology limits */
+#define SCSI_SAMPLE_MAX_TGTS            128
+#define SCSI_SAMPLE_MAX_LUNS_PER_TGT    1024
+#define SCSI_SAMPLE_MAX_LUN_PARAMS      256
+
 #define SCSI_SAMPLE_VERSION     "0.1"
 
 /* Debug print macros */
@@ -14,10 +27,90 @@
 #define SS_DEBUG_WARN(format, ...) \
     pr_warn("scsi_sample: " format "\n", ##__VA_ARGS__)
 
+/* For the command path, compiled out unless dynamic debug turns it on */
+#define SS_DEBUG_DBG(format, ...) \
+    pr_debug("scsi_sample: " format "\n", ##__VA_ARGS__)
+
 #define DRIVER_NAME     "scsi_sample"
 
-struct scsi_sample {
+/* We only do 512 byte logical blocks */
+#define SCSI_SAMPLE_BLOCK_SHIFT 9
+#define SCSI_SAMPLE_BLOCK_SIZE  (1 << SCSI_SAMPLE_BLOCK_SHIFT)
+
+/* Largest transfer advertised in the block limits VPD page, in blocks */
+#define SCSI_SAMPLE_MAX_XFER    2048
+
+/* Discard limits advertised in the block limits VPD page */
+#define SCSI_SAMPLE_MAX_UNMAP       65536
+#define SCSI_SAMPLE_MAX_UNMAP_DESC  256
+
+/* Longest WRITE SAME, in blocks, bounded by what we copy without rescheduling */
+#define SCSI_SAMPLE_MAX_WRITE_SAME  SCSI_SAMPLE_MAX_XFER
+
+/* Blocks per page of the sparse store */
+#define SCSI_SAMPLE_PAGE_BLOCKS     (PAGE_SIZE >> SCSI_SAMPLE_BLOCK_SHIFT)
+
+/* Longest INQUIRY, MODE SENSE or REPORT LUNS response we build */
+#define SCSI_SAMPLE_RESP_LEN    256
+
+/* Per-LUN counters, kept per CPU so the submission path never shares them */
+struct scsi_sample_lun_stats {
+    u64 reads;
+    u64 writes;
+    u64 read_bytes;
+    u64 write_bytes;
+    u64 unmaps;
+    u64 errors;
+};
+
+/* One emulated logical unit, hung off scsi_device->hostdata */
+struct scsi_sample_lun {
+    /* Flat store, or NULL when pages are allocated on first write */
     void *backing_store;
+    struct xarray pages;
+    atomic_long_t nr_pages;
+    u64 num_blocks;
+    unsigned int id;
+    u64 lun;
+    unsigned int queue_depth;
+    struct scsi_sample_lun_stats __percpu *stats;
+};
+
+/* Jitter distributions for the completion engine */
+enum {
+    SCSI_SAMPLE_JITTER_UNIFORM,
+    SCSI_SAMPLE_JITTER_EXP,
+};
+
+/*
+ * Completion engine state of one hardware queue: commands waiting for
+ * their emulated completion time, ordered by deadline.
+ */
+struct scsi_sample_queue {
+    spinlock_t lock;
+    struct timerqueue_head pending;
+    struct hrtimer timer;
+} ____cacheline_aligned_in_smp;
+
+/* Per-command driver data, preallocated by the midlayer via cmd_size */
+struct scsi_sample_cmd {
+    struct scsi_cmnd *cmd;
+    struct scsi_sample_queue *q;
+    struct timerqueue_node node;
+    struct list_head list;
+};
+
+struct scsi_sample {
+    /* num_tgts * luns_per_tgt LUNs, indexed by id * luns_per_tgt + lun */
+    struct scsi_sample_lun *luns;
+    unsigned int num_luns;
+    /* One per hardware queue */
+    struct scsi_sample_queue *queues;
+    /*
+     * Earliest completion time in ns the IOPS cap allows for the next
+     * command, shared by every queue so max_iops is a host-wide limit
+     */
+    atomic64_t next_slot;
     struct device *fake_root_device;
     struct device dev;
     struct Scsi_Host *shost;